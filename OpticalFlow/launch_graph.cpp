@@ -0,0 +1,99 @@
+#include "launch_graph.hpp"
+
+#include <stdexcept>
+
+void addKernelTime(KernelTimes& times, std::string const& name, cl::Event const& event)
+{
+	auto start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	auto end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	times[name] += end - start;
+}
+
+const LaunchGraph::Node LaunchGraph::NO_NODE;
+
+LaunchGraph::Node LaunchGraph::addInput(std::string const& name)
+{
+	GraphNode node;
+	node.type = NodeType::Input;
+	node.name = name;
+	return addNode(node);
+}
+
+LaunchGraph::Node LaunchGraph::addKernel(std::string const& name, cl::Kernel const& kernel, cl::NDRange const& globalSize, cl::NDRange const& localSize,
+	std::vector<Node> const& dependencies)
+{
+	GraphNode node;
+	node.type = NodeType::Kernel;
+	node.name = name;
+	node.dependencies = dependencies;
+	node.kernel = kernel;
+	node.globalSize = globalSize;
+	node.localSize = localSize;
+	return addNode(node);
+}
+
+LaunchGraph::Node LaunchGraph::addCopyToBuffer(std::string const& name, cl::Image2D const& source, cl::Buffer const& target, cl::NDRange const& dimension,
+	std::vector<Node> const& dependencies)
+{
+	GraphNode node;
+	node.type = NodeType::CopyToBuffer;
+	node.name = name;
+	node.dependencies = dependencies;
+	node.source = source;
+	node.target = target;
+	node.region[0] = dimension[0];
+	node.region[1] = dimension[1];
+	node.region[2] = 1;
+	return addNode(node);
+}
+
+LaunchGraph::Node LaunchGraph::addNode(GraphNode node)
+{
+	for (auto dependency : node.dependencies)
+	{
+		if (dependency >= m_nodes.size())
+			throw std::logic_error("Node '" + node.name + "' depends on a node which is added later");
+	}
+
+	node.enabled = true;
+	m_nodes.push_back(node);
+	return m_nodes.size() - 1;
+}
+
+void LaunchGraph::setInput(Node node, cl::Event const& event)
+{
+	m_nodes[node].event = event;
+}
+
+void LaunchGraph::replay(cl::CommandQueue const& queue)
+{
+	cl::size_t<3> origin;
+
+	for (auto& node : m_nodes)
+	{
+		if (node.type == NodeType::Input || !node.enabled)
+			continue;
+
+		node.waitEvents.clear();
+		for (auto dependency : node.dependencies)
+		{
+			if (m_nodes[dependency].enabled)
+				node.waitEvents.push_back(m_nodes[dependency].event);
+		}
+		auto* waitEvents = node.waitEvents.empty() ? nullptr : &node.waitEvents;
+
+		if (node.type == NodeType::Kernel)
+			queue.enqueueNDRangeKernel(node.kernel, cl::NullRange, node.globalSize, node.localSize, waitEvents, &node.event);
+		else
+			queue.enqueueCopyImageToBuffer(node.source, node.target, origin, node.region, 0, waitEvents, &node.event);
+	}
+}
+
+void LaunchGraph::addKernelTimes(KernelTimes& times) const
+{
+	for (auto& node : m_nodes)
+	{
+		if (node.type == NodeType::Kernel && node.enabled)
+			addKernelTime(times, node.name, node.event);
+	}
+}
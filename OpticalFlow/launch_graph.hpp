@@ -0,0 +1,87 @@
+#pragma once
+
+#include "runtime.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Accumulated execution time in ns per kernel name
+typedef std::map<std::string, cl_ulong> KernelTimes;
+
+void addKernelTime(KernelTimes& times, std::string const& name, cl::Event const& event);
+
+// A fixed sequence of commands with all kernel arguments bound once. Every node depends on
+// earlier nodes only, so replaying the nodes in order enqueues a valid event graph. Input
+// nodes stand for commands enqueued outside of the graph (e.g. uploads), their events have
+// to be set before every replay. Disabled nodes are skipped and nodes depending on them do not
+// wait for them, so the caller has to disable a node only if its output is not needed.
+//
+// Dependencies only exist within one replay. The next replay overwrites the images read by
+// the previous one (e.g. the flow of the previous pair is the input of the temporal
+// prediction), so the graph has to be replayed on an in-order queue, which finishes the
+// commands of a replay before the next one starts. Out-of-order queues are not supported.
+//
+// Each kernel node owns its own cl::Kernel instance. Kernels are not shared between graphs,
+// so different graphs can be replayed from different threads at the same time.
+class LaunchGraph
+{
+public:
+	typedef std::size_t Node;
+
+	static const Node NO_NODE = (Node)-1;
+
+	Node addInput(std::string const& name);
+
+	Node addKernel(std::string const& name, cl::Kernel const& kernel, cl::NDRange const& globalSize, cl::NDRange const& localSize,
+		std::vector<Node> const& dependencies);
+
+	Node addCopyToBuffer(std::string const& name, cl::Image2D const& source, cl::Buffer const& target, cl::NDRange const& dimension,
+		std::vector<Node> const& dependencies);
+
+	void setInput(Node node, cl::Event const& event);
+
+	void setEnabled(Node node, bool enabled) { m_nodes[node].enabled = enabled; }
+
+	bool isEnabled(Node node) const { return m_nodes[node].enabled; }
+
+	// Enqueues all nodes in the order they were added, the queue has to be in-order
+	void replay(cl::CommandQueue const& queue);
+
+	cl::Event const& getEvent(Node node) const { return m_nodes[node].event; }
+
+	std::size_t getLaunchCount() const { return m_nodes.size(); }
+
+	// Adds the execution time of every enabled kernel node of the last replay
+	void addKernelTimes(KernelTimes& times) const;
+
+private:
+	enum class NodeType
+	{
+		Input,
+		Kernel,
+		CopyToBuffer
+	};
+
+	struct GraphNode
+	{
+		NodeType type;
+		std::string name;
+		bool enabled;
+		std::vector<Node> dependencies;
+		std::vector<cl::Event> waitEvents;
+		cl::Event event;
+
+		cl::Kernel kernel;
+		cl::NDRange globalSize;
+		cl::NDRange localSize;
+
+		cl::Image2D source;
+		cl::Buffer target;
+		cl::size_t<3> region;
+	};
+
+	Node addNode(GraphNode node);
+
+	std::vector<GraphNode> m_nodes;
+};
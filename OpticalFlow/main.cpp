@@ -1,4 +1,6 @@
 #include "runtime.hpp"
+#include "tuning.hpp"
+#include "stream_scheduler.hpp"
 
 #include <boost/gil/image.hpp>
 #include <boost/gil/extension/io/jpeg_io.hpp>
@@ -6,6 +8,10 @@
 #include <iostream>
 #include <fstream>
 #include <array>
+#include <map>
+#include <chrono>
+#include <memory>
+#include <cmath>
 #include <cstdint>
 #include <ctime>
 #include <random>
@@ -16,200 +22,38 @@ const std::string FIRST_IMAGE = "images/frame10.jpg";
 const std::string SECOND_IMAGE = "images/frame11.jpg";
 const std::string PROGRAM_FILE = "optical-flow.cl";
 
-void saveImage(cl::CommandQueue const& queue, cl::Image2D const& source, std::string targetFile, std::vector<cl::Event> const& waitEvents)
-{
-	TimedEvent event("save_image");
-	auto mappedImage = mapImage(queue, source, CL_MAP_READ, &waitEvents);
-	auto* mappedImageData = (gil::gray8_pixel_t*)mappedImage.data;
-	auto width = source.getImageInfo<CL_IMAGE_WIDTH>();
-	auto height = source.getImageInfo<CL_IMAGE_HEIGHT>();
-	auto view = gil::interleaved_view(width, height, mappedImageData, mappedImage.rowSize);
-	jpeg_write_view(targetFile, view);
-	queue.enqueueUnmapMemObject(source, mappedImageData);
-}
-
-struct RangeColorConverter
-{
-	RangeColorConverter(int minValue, int maxValue)
-		: m_min(minValue), m_max(maxValue)
-	{ }
-
-	template <typename SrcT>
-	void operator () (SrcT const& src, gil::gray8_pixel_t& dst) const
-	{
-		const float range = (float)(m_max - m_min);
-		int value = src[0] - m_min;
-		float t = (float)value / range;
-		dst[0] = (uint8_t)(t*255);
-	}
-
-	int m_min, m_max;
-};
-
-struct RangeColorConverter1
-{
-	RangeColorConverter1(int minValue, int maxValue)
-		: m_min(minValue), m_max(maxValue)
-	{ }
-
-	template <typename SrcT>
-	void operator () (SrcT const& src, gil::gray8_pixel_t& dst) const
-	{
-		const float range = (float)(m_max - m_min);
-		int value = src[1] - m_min;
-		float t = (float)value / range;
-		dst[0] = (uint8_t)(t * 255);
-	}
-
-	int m_min, m_max;
-};
-
-struct RangeColorConverterI
-{
-	RangeColorConverterI(int index, int minValue, int maxValue)
-		: m_index(index), m_min(minValue), m_max(maxValue)
-	{ }
-
-	template <typename SrcT>
-	void operator () (SrcT const& src, gil::gray8_pixel_t& dst) const
-	{
-		const float range = (float)(m_max - m_min);
-		int value = src[m_index] - m_min;
-		float t = (float)value / range;
-		dst[0] = (uint8_t)(t * 255);
-	}
-
-	int m_index, m_min, m_max;
-};
-
-struct RangeColorConverterF
-{
-	RangeColorConverterF(int index, float minValue, float maxValue)
-		: m_index(index), m_min(minValue), m_max(maxValue)
-	{ }
-
-	template <typename SrcT>
-	void operator () (SrcT const& src, gil::gray8_pixel_t& dst) const
-	{
-		const float range = (float)(m_max - m_min);
-		float value = src[m_index] - m_min;
-		float t = (float)value / range;
-		dst[0] = (uint8_t)(t * 255);
-	}
-
-	int m_index;
-	float m_min, m_max;
-};
-
-void saveScharrImage(cl::CommandQueue const& queue, cl::Image2D const& source, std::string targetFile, std::vector<cl::Event> const& waitEvents)
-{
-	TimedEvent event("save_image");
-	auto mappedImage = mapImage(queue, source, CL_MAP_READ, &waitEvents);
-	auto* mappedImageData = (gil::gray16s_pixel_t*)mappedImage.data;
-	auto width = source.getImageInfo<CL_IMAGE_WIDTH>();
-	auto height = source.getImageInfo<CL_IMAGE_HEIGHT>();
-	auto view = gil::interleaved_view(width, height, mappedImageData, mappedImage.rowSize);
-	
-	auto rawPixel = view(3, 0);
-	int minC = INT16_MAX;
-	int maxC = INT16_MIN;
-	std::function<void(gil::gray16s_pixel_t const& pix)> minMax = [&](gil::gray16s_pixel_t const& pix)
-	{
-		if (pix[0] < minC)
-			minC = pix[0];
-		else if (pix[0] > maxC)
-			maxC = pix[0];
-	};
-	boost::gil::for_each_pixel(view, minMax);
-	RangeColorConverter converter(minC, maxC);
-	auto colorConverted = boost::gil::color_converted_view<boost::gil::gray8_pixel_t>(view, converter);
-	auto convertedPixel = colorConverted(3, 0);
-	jpeg_write_view(targetFile, colorConverted);
-	queue.enqueueUnmapMemObject(source, mappedImageData);
-}
+// Set to 1 to compute the flow on RGBA instead of gray images. The pyramids carry all
+// channels in one image, G and the mismatch vector are averaged over the color channels
+// (alpha is constant and skipped), so they have the scale of gray and share its thresholds.
+#define COLOR_INPUT 0
+
+#if COLOR_INPUT
+typedef gil::rgba8_image_t InputImage;
+typedef gil::rgba8_pixel_t InputPixel;
+typedef gil::rgba16s_pixel_t ScharrPixel;
+typedef gil::rgb8_pixel_t JpegPixel;
+const std::size_t CHANNELS = 4;
+const cl::ImageFormat IMAGE_FORMAT(CL_RGBA, CL_UNSIGNED_INT8);
+const cl::ImageFormat SCHARR_FORMAT(CL_RGBA, CL_SIGNED_INT16);
+#else
+typedef gil::gray8_image_t InputImage;
+typedef gil::gray8_pixel_t InputPixel;
+typedef gil::gray16s_pixel_t ScharrPixel;
+typedef gil::gray8_pixel_t JpegPixel;
+const std::size_t CHANNELS = 1;
+const cl::ImageFormat IMAGE_FORMAT(CL_R, CL_UNSIGNED_INT8);
+const cl::ImageFormat SCHARR_FORMAT(CL_R, CL_SIGNED_INT16);
+#endif
 
-void saveGMatrix(cl::CommandQueue const& queue, cl::Image2D const& source, std::string targetFile, std::vector<cl::Event> const& waitEvents, int index)
+void saveImage(cl::CommandQueue const& queue, cl::Image2D const& source, std::string targetFile, std::vector<cl::Event> const& waitEvents)
 {
 	TimedEvent event("save_image");
 	auto mappedImage = mapImage(queue, source, CL_MAP_READ, &waitEvents);
-	auto* mappedImageData = (gil::rgba32s_pixel_t*)mappedImage.data;
+	auto* mappedImageData = (InputPixel*)mappedImage.data;
 	auto width = source.getImageInfo<CL_IMAGE_WIDTH>();
 	auto height = source.getImageInfo<CL_IMAGE_HEIGHT>();
 	auto view = gil::interleaved_view(width, height, mappedImageData, mappedImage.rowSize);
-
-	int32_t minC = INT32_MAX;
-	int32_t maxC = INT32_MIN;
-	std::function<void(gil::rgba32s_pixel_t const& pix)> minMax = [&](gil::rgba32s_pixel_t const& pix)
-	{
-		auto value = pix[index];
-		if (value < minC)
-			minC = value;
-		else if (value > maxC)
-			maxC = value;
-	};
-	boost::gil::for_each_pixel(view, minMax);
-	RangeColorConverterI converter(index, minC, maxC);
-	auto rawPixel = view(1, 0);
-	auto colorConverted = boost::gil::color_converted_view<boost::gil::gray8_pixel_t>(view, converter);
-	auto convertedPixel = colorConverted(1, 0);
-	jpeg_write_view(targetFile, colorConverted);
-	queue.enqueueUnmapMemObject(source, mappedImageData);
-}
-
-void saveFlow(cl::CommandQueue const& queue, cl::Image2D const& source, std::string targetFile, std::vector<cl::Event> const& waitEvents, int index)
-{
-	TimedEvent event("save_image");
-	auto mappedImage = mapImage(queue, source, CL_MAP_READ, &waitEvents);
-	auto* mappedImageData = (gil::gray32f_pixel_t*)mappedImage.data;
-	auto width = source.getImageInfo<CL_IMAGE_WIDTH>();
-	auto height = source.getImageInfo<CL_IMAGE_HEIGHT>();
-	std::vector<gil::gray32f_pixel_t> oneChannel(width * height);
-	for (int i = 0; i < width * height; ++i)
-	{
-		oneChannel[i] = mappedImageData[2 * i + index];
-	}
-
-	auto rowSize = mappedImage.rowSize / 2;
-	auto view = gil::interleaved_view(width, height, oneChannel.data(), rowSize);
-
-	float minC = 1000.0f;
-	float maxC = -1000.0f;
-	std::function<void(gil::gray32f_pixel_t const& pix)> minmax = [&](gil::gray32f_pixel_t const& pix)
-	{
-		auto value = pix[0];
-		if (value < minC)
-			minC = value;
-		else if (value > maxC)
-			maxC = value;
-	};
-	int maxX = 0;
-	int maxY = 0;
-	int minX = 0;
-	int minY = 0;
-	for (int y = 0; y < height; ++y)
-		for (int x = 0; x < width; ++x)
-		{
-			auto value = view(x, y)[0];
-			if (value < minC)
-			{
-				minC = value;
-				minX = x;
-				minY = y;
-			}
-			else if (value > maxC)
-			{
-				maxC = value;
-				maxX = x; 
-				maxY = y;
-			}
-		}
-	//boost::gil::for_each_pixel(view, minmax);
-	std::cout << targetFile << " min: " << minC << " max: " << maxC << std::endl;
-	std::cout << targetFile << " maxX: " << maxX << " maxY: " << maxY << std::endl;
-	std::cout << targetFile << " minX: " << minX << " minY: " << minY << std::endl;
-	RangeColorConverterF converter(0, minC, maxC);
-	auto colorConverted = boost::gil::color_converted_view<boost::gil::gray8_pixel_t>(view, converter);
-	jpeg_write_view(targetFile, colorConverted);
+	jpeg_write_view(targetFile, gil::color_converted_view<JpegPixel>(view));
 	queue.enqueueUnmapMemObject(source, mappedImageData);
 }
 
@@ -238,53 +82,110 @@ const cl_mem_flags INPUT_MEMORY_FLAGS = CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY
 const cl_mem_flags OUTPUT_MEMORY_FLAGS = CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE;
 
 const std::size_t PYRAMID_HEIGHT = 3;
-const cl::ImageFormat IMAGE_FORMAT(CL_R, CL_UNSIGNED_INT8);
+
+// How the flow kernel samples the second image J. Image uses the bilinear image sampler
+// (optical_flow_2), Buffer interpolates in float from a plain buffer copy of each pyramid
+// level (optical_flow_buffer), which is much faster on runtimes that emulate image filtering.
+// FixedPoint samples the same buffers but computes the whole iteration in integers
+// (optical_flow_fixed) for CPU and embedded devices with a much higher integer throughput.
+enum class FlowSampling
+{
+	Image,
+	Buffer,
+	FixedPoint
+};
+
+const FlowSampling FLOW_SAMPLING = FlowSampling::Buffer;
+
+inline const char* flowKernelName(FlowSampling sampling)
+{
+	switch (sampling)
+	{
+	case FlowSampling::Buffer:
+		return "optical_flow_buffer";
+	case FlowSampling::FixedPoint:
+		return "optical_flow_fixed";
+	default:
+		return "optical_flow_2";
+	}
+}
+
+inline bool samplesBuffers(FlowSampling sampling)
+{
+	return sampling != FlowSampling::Image;
+}
+
+// The pyramid classes allocate their images and add their launches to a LaunchGraph. Every
+// launch gets its own kernel instance with the arguments bound once, the graph is enqueued
+// by LaunchGraph::replay for every frame.
 
 class ImagePyramid
 {
 public:
-	ImagePyramid(gil::gray8_image_t const& image, cl::Context const& context, cl::CommandQueue const& queue,
-		cl::Kernel& downFilterX, cl::Kernel& downFilterY)
+	ImagePyramid(cl::Context const& context, cl::Program const& program, LaunchGraph& graph, TuningTable const& tuning,
+		std::size_t width, std::size_t height, bool withBuffers = false)
+		: m_graph(&graph), m_hasBuffers(withBuffers)
 	{
 		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
 		{
 			// Half the dimensions with every level
-			auto width = image.width() >> i;
-			auto height = image.height() >> i;
-			m_dimensions[i] = cl::NDRange(width, height);
+			m_dimensions[i] = cl::NDRange(width >> i, height >> i);
 
 			cl_mem_flags memoryFlags = (i == 0) ? INPUT_MEMORY_FLAGS : INTERMEDIATE_MEMORY_FLAGS;
 			m_images[i] = createImage(context, memoryFlags, IMAGE_FORMAT, m_dimensions[i]);
 		}
 
-		// Copy level 0
-		m_finished[0] = copyImage(queue, image, m_images[0]);
+		// Level 0 is copied from the host by upload()
+		m_finished[0] = graph.addInput("copy");
 
 		// Downfiltering for levels 1 and 2
-		std::vector<cl::Event> waitEvents(1);
-
 		for (std::size_t i = 0; i < PYRAMID_HEIGHT - 1; ++i)
 		{
 			m_intermediateImages[i] = createImage(context, INTERMEDIATE_MEMORY_FLAGS, IMAGE_FORMAT, m_dimensions[i]);
+
+			cl::Kernel downFilterX(program, "downfilter_x");
 			downFilterX.setArg(0, m_images[i]);
 			downFilterX.setArg(1, m_intermediateImages[i]);
+			m_intermediateNodes[i] = addTunedKernel(graph, tuning, "downfilter_x", downFilterX, m_dimensions[i], { m_finished[i] });
 
-			waitEvents[0] = m_finished[i];
-			queue.enqueueNDRangeKernel(downFilterX, cl::NullRange, m_dimensions[i], cl::NullRange, &waitEvents, &m_intermediateEvents[i]);
-
+			cl::Kernel downFilterY(program, "downfilter_y");
 			downFilterY.setArg(0, m_intermediateImages[i]);
 			downFilterY.setArg(1, m_images[i + 1]);
+			m_finished[i + 1] = addTunedKernel(graph, tuning, "downfilter_y", downFilterY, m_dimensions[i + 1], { m_intermediateNodes[i] });
+		}
+
+		// Tightly packed buffer copies of all levels for kernels which sample without the image unit
+		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
+		{
+			m_bufferFinished[i] = LaunchGraph::NO_NODE;
+			if (!m_hasBuffers)
+				continue;
 
-			waitEvents[0] = m_intermediateEvents[i];
-			queue.enqueueNDRangeKernel(downFilterY, cl::NullRange, m_dimensions[i + 1], cl::NullRange, &waitEvents, &m_finished[i + 1]);
+			m_buffers[i] = cl::Buffer(context, INTERMEDIATE_MEMORY_FLAGS, m_dimensions[i][0] * m_dimensions[i][1] * CHANNELS);
+			m_bufferFinished[i] = graph.addCopyToBuffer("copy_to_buffer", m_images[i], m_buffers[i], m_dimensions[i], { m_finished[i] });
 		}
 	}
 
+	// Enqueues the copy of the frame into level 0, has to be called before the graph is
+	// replayed. The frame is read asynchronously and has to stay unchanged until then.
+	void upload(cl::CommandQueue const& queue, InputImage const& image)
+	{
+		m_graph->setInput(m_finished[0], copyImage(queue, image, m_images[0]));
+	}
+
 	cl::Image2D const& getImage(std::size_t level) const { return m_images[level]; }
 
 	cl::NDRange const& getDimension(std::size_t level) const { return m_dimensions[level]; }
 
-	cl::Event const& getFinished(std::size_t level) const { return m_finished[level]; }
+	LaunchGraph::Node getFinishedNode(std::size_t level) const { return m_finished[level]; }
+
+	cl::Event const& getFinished(std::size_t level) const { return m_graph->getEvent(m_finished[level]); }
+
+	bool hasBuffers() const { return m_hasBuffers; }
+
+	cl::Buffer const& getBuffer(std::size_t level) const { return m_buffers[level]; }
+
+	LaunchGraph::Node getBufferFinishedNode(std::size_t level) const { return m_bufferFinished[level]; }
 
 	void writeProfile(std::ostream& out, std::string const& baseName, cl_ulong baseCounter)
 	{
@@ -292,46 +193,57 @@ public:
 
 		for (std::size_t i = 0; i < PYRAMID_HEIGHT - 1; ++i)
 		{
-			writeProfileInfo(out, m_intermediateEvents[i], baseName + " downfilter X level " + std::to_string(i + 1), baseCounter);
+			writeProfileInfo(out, m_graph->getEvent(m_intermediateNodes[i]), baseName + " downfilter X level " + std::to_string(i + 1), baseCounter);
 			writeProfileInfo(out, getFinished(i + 1), baseName + " downfilter Y level " + std::to_string(i + 1), baseCounter);
 		}
+
+		if (m_hasBuffers)
+		{
+			for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
+			{
+				writeProfileInfo(out, m_graph->getEvent(m_bufferFinished[i]), baseName + " buffer copy level " + std::to_string(i), baseCounter);
+			}
+		}
 	}
 
 private:
+	LaunchGraph* m_graph;
+
 	std::array<cl::Image2D, PYRAMID_HEIGHT> m_images;
 	std::array<cl::NDRange, PYRAMID_HEIGHT> m_dimensions;
-	std::array<cl::Event, PYRAMID_HEIGHT> m_finished;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT> m_finished;
+
+	bool m_hasBuffers;
+	std::array<cl::Buffer, PYRAMID_HEIGHT> m_buffers;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT> m_bufferFinished;
 
 	std::array<cl::Image2D, PYRAMID_HEIGHT - 1> m_intermediateImages;
-	std::array<cl::Event, PYRAMID_HEIGHT - 1> m_intermediateEvents;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT - 1> m_intermediateNodes;
 };
 
-const cl::ImageFormat SCHARR_FORMAT(CL_R, CL_SIGNED_INT16);
-
 class ScharrPyramid
 {
 public:
-	ScharrPyramid(cl::Context const& context, cl::CommandQueue const& queue, cl::Kernel& filterHorizontal, cl::Kernel& filterVertical,
-		ImagePyramid const& basePyramid)
+	ScharrPyramid(cl::Context const& context, cl::Program const& program, LaunchGraph& graph, TuningTable const& tuning,
+		std::string const& horizontalKernel, std::string const& verticalKernel, ImagePyramid const& basePyramid)
+		: m_graph(&graph)
 	{
-		std::vector<cl::Event> waitEvents(1);
-
 		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
 		{
 			auto& dimension = basePyramid.getDimension(i);
 			m_dimensions[i] = dimension;
 
 			m_intermediates[i] = createImage(context, INTERMEDIATE_MEMORY_FLAGS, SCHARR_FORMAT, dimension);
+			cl::Kernel filterHorizontal(program, horizontalKernel.c_str());
 			filterHorizontal.setArg(0, basePyramid.getImage(i));
 			filterHorizontal.setArg(1, m_intermediates[i]);
-			waitEvents[0] = basePyramid.getFinished(i);
-			queue.enqueueNDRangeKernel(filterHorizontal, cl::NullRange, dimension, cl::NullRange, &waitEvents, &m_intermediateEvents[i]);
+			m_intermediateNodes[i] = addTunedKernel(graph, tuning, horizontalKernel, filterHorizontal, dimension, { basePyramid.getFinishedNode(i) });
 
 			m_derivatives[i] = createImage(context, INTERMEDIATE_MEMORY_FLAGS, SCHARR_FORMAT, dimension);
+			cl::Kernel filterVertical(program, verticalKernel.c_str());
 			filterVertical.setArg(0, m_intermediates[i]);
 			filterVertical.setArg(1, m_derivatives[i]);
-			waitEvents[0] = m_intermediateEvents[i];
-			queue.enqueueNDRangeKernel(filterVertical, cl::NullRange, dimension, cl::NullRange, &waitEvents, &m_finished[i]);
+			m_finished[i] = addTunedKernel(graph, tuning, verticalKernel, filterVertical, dimension, { m_intermediateNodes[i] });
 		}
 	}
 
@@ -339,23 +251,27 @@ public:
 
 	cl::NDRange const& getDimension(std::size_t level) const { return m_dimensions[level]; }
 
-	cl::Event const& getFinished(std::size_t level) const { return m_finished[level]; }
+	LaunchGraph::Node getFinishedNode(std::size_t level) const { return m_finished[level]; }
+
+	cl::Event const& getFinished(std::size_t level) const { return m_graph->getEvent(m_finished[level]); }
 
 	void writeProfile(std::ostream& out, std::string const& baseName, cl_ulong baseCounter)
 	{
 		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
 		{
-			writeProfileInfo(out, m_intermediateEvents[i], baseName + " scharr hor level " + std::to_string(i), baseCounter);
+			writeProfileInfo(out, m_graph->getEvent(m_intermediateNodes[i]), baseName + " scharr hor level " + std::to_string(i), baseCounter);
 			writeProfileInfo(out, getFinished(i), baseName + " scharr ver level " + std::to_string(i), baseCounter);
 		}
 	}
 
 private:
+	LaunchGraph* m_graph;
+
 	std::array<cl::Image2D, PYRAMID_HEIGHT> m_derivatives;
 	std::array<cl::Image2D, PYRAMID_HEIGHT> m_intermediates;
 	std::array<cl::NDRange, PYRAMID_HEIGHT> m_dimensions;
-	std::array<cl::Event, PYRAMID_HEIGHT> m_finished;
-	std::array<cl::Event, PYRAMID_HEIGHT> m_intermediateEvents;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT> m_finished;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT> m_intermediateNodes;
 };
 
 const cl::ImageFormat G_MATRIX_FORMAT(CL_RGBA, CL_SIGNED_INT32);
@@ -363,29 +279,29 @@ const cl::ImageFormat G_MATRIX_FORMAT(CL_RGBA, CL_SIGNED_INT32);
 class GMatrixPyramid
 {
 public:
-	GMatrixPyramid(cl::Context const& context, cl::CommandQueue const& queue, cl::Kernel& filterG,
+	GMatrixPyramid(cl::Context const& context, cl::Program const& program, LaunchGraph& graph, TuningTable const& tuning,
 		ScharrPyramid const& derivativeX, ScharrPyramid const& derivativeY)
+		: m_graph(&graph)
 	{
-		std::vector<cl::Event> waitEvents(2);
-
 		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
 		{
 			auto& dimension = derivativeX.getDimension(i);
 			m_matrices[i] = createImage(context, INTERMEDIATE_MEMORY_FLAGS, G_MATRIX_FORMAT, derivativeX.getDimension(i));
 
+			cl::Kernel filterG(program, "filter_G");
 			filterG.setArg(0, derivativeX.getDerivative(i));
 			filterG.setArg(1, derivativeY.getDerivative(i));
 			filterG.setArg(2, m_matrices[i]);
-
-			waitEvents[0] = derivativeX.getFinished(i);
-			waitEvents[1] = derivativeY.getFinished(i);
-			queue.enqueueNDRangeKernel(filterG, cl::NullRange, dimension, cl::NullRange, &waitEvents, &m_finished[i]);
+			m_finished[i] = addTunedKernel(graph, tuning, "filter_G", filterG, dimension,
+				{ derivativeX.getFinishedNode(i), derivativeY.getFinishedNode(i) });
 		}
 	}
 
 	cl::Image2D const& getMatrix(std::size_t level) const { return m_matrices[level]; }
 
-	cl::Event const& getFinished(std::size_t level) const { return m_finished[level]; }
+	LaunchGraph::Node getFinishedNode(std::size_t level) const { return m_finished[level]; }
+
+	cl::Event const& getFinished(std::size_t level) const { return m_graph->getEvent(m_finished[level]); }
 
 	void writeProfile(std::ostream& out, std::string const& baseName, cl_ulong baseCounter)
 	{
@@ -396,240 +312,1601 @@ public:
 	}
 
 private:
+	LaunchGraph* m_graph;
+
 	std::array<cl::Image2D, PYRAMID_HEIGHT> m_matrices;
-	std::array<cl::Event, PYRAMID_HEIGHT> m_finished;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT> m_finished;
 };
 
 const cl::ImageFormat FLOW_VECTOR_FORMAT(CL_RG, CL_FLOAT);
 
-// Helper to get next up value for integer division
-static inline size_t DivUp(size_t dividend, size_t divisor)
+// Dense flow of every pyramid level in pixels of that level. Implemented by the Lucas-Kanade
+// FlowPyramid and the patch inverse search PatchFlowPyramid.
+class FlowEstimator
 {
-	return (dividend % divisor == 0) ? (dividend / divisor) : (dividend / divisor + 1);
-}
+public:
+	virtual ~FlowEstimator() { }
+
+	virtual cl::Image2D const& getVector(std::size_t level) const = 0;
+
+	virtual LaunchGraph::Node getFinishedNode(std::size_t level) const = 0;
+
+	virtual cl::Event const& getFinished(std::size_t level) const = 0;
+
+	virtual void writeProfile(std::ostream& out, std::string const& baseName, cl_ulong baseCounter) = 0;
+};
 
-class FlowPyramid
+enum class FlowEngine
+{
+	// Iterative Lucas-Kanade window at every pixel (optical_flow_2 or optical_flow_buffer)
+	LucasKanade,
+	// DIS patch inverse search on a sparse grid with densification
+	PatchInverseSearch
+};
+
+const FlowEngine FLOW_ENGINE = FlowEngine::LucasKanade;
+
+// Number of iterations per pixel of the flow kernels, written for every level. Pixels which
+// did not converge get the iteration limit + 1, so the limit has to stay below 255.
+const cl::ImageFormat ITERATION_FORMAT(CL_R, CL_UNSIGNED_INT8);
+
+// use_guess of the flow kernels, see GUESS_* in optical-flow.cl
+const std::int32_t GUESS_NONE = 0;
+const std::int32_t GUESS_PYRAMID = 1;
+const std::int32_t GUESS_TEMPORAL = 2;
+
+const std::int32_t FLOW_ITERATIONS = 8;
+
+// Initial guess of the top pyramid level for the next frame pair
+enum class TemporalPrediction
+{
+	None,
+	// Level 0 flow of the previous pair, box filtered down to the top level
+	Downsampled,
+	// Flow of the previous pair at the top level
+	Coarse
+};
+
+struct TemporalOptions
+{
+	TemporalPrediction prediction;
+	// Coarsest level computed while the prediction is good, the levels above it are skipped
+	std::size_t predictedTopLevel;
+	// Iterations of every level without and with a prediction
+	std::int32_t fullIterations;
+	std::int32_t predictedIterations;
+	// A pair starts without prediction if a larger fraction of the top level pixels of the
+	// previous predicted pair did not converge
+	float maxSaturatedFraction;
+};
+
+const TemporalOptions NO_TEMPORAL_PREDICTION = { TemporalPrediction::None, PYRAMID_HEIGHT - 1, FLOW_ITERATIONS, FLOW_ITERATIONS, 0.0f };
+const TemporalOptions DEFAULT_TEMPORAL_PREDICTION = { TemporalPrediction::Downsampled, PYRAMID_HEIGHT - 1, FLOW_ITERATIONS, 4, 0.1f };
+
+class FlowPyramid : public FlowEstimator
 {
 public:
-	FlowPyramid(cl::Context const& context, cl::CommandQueue const& queue, cl::Kernel& calcFlow,
+	FlowPyramid(cl::Context const& context, cl::Program const& program, LaunchGraph& graph, TuningTable const& tuning,
 		ImagePyramid const& first, ImagePyramid const& second,
 		ScharrPyramid const& derivativeX, ScharrPyramid const& derivativeY,
-		GMatrixPyramid const& matrixG)
+		GMatrixPyramid const& matrixG, FlowSampling sampling, TemporalOptions const& temporal)
+		: m_graph(&graph), m_temporal(temporal), m_predicted(false), m_predictionNode(LaunchGraph::NO_NODE)
 	{
-		std::vector<cl::Event> waitEvents(1);
+		if (samplesBuffers(sampling) && !second.hasBuffers())
+			throw std::runtime_error("Buffer and fixed point sampling need an image pyramid with buffers");
+		if (temporal.predictedTopLevel >= PYRAMID_HEIGHT)
+			throw std::invalid_argument("The predicted top level has to be a level of the pyramid");
+
+		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
+		{
+			m_vectors[i] = createImage(context, OUTPUT_MEMORY_FLAGS, FLOW_VECTOR_FORMAT, first.getDimension(i));
+			m_iterations[i] = createImage(context, OUTPUT_MEMORY_FLAGS, ITERATION_FORMAT, first.getDimension(i));
+		}
+
+		// Reads the flow of the previous pair, so it is only enabled once a pair was processed.
+		// The flow images are overwritten after the prediction because the top level depends on it.
+		auto topLevel = temporal.predictedTopLevel;
+		if (temporal.prediction != TemporalPrediction::None)
+		{
+			auto& dimension = first.getDimension(topLevel);
+			m_prediction = createImage(context, INTERMEDIATE_MEMORY_FLAGS, FLOW_VECTOR_FORMAT, dimension);
+
+			bool downsampled = temporal.prediction == TemporalPrediction::Downsampled;
+			cl::Kernel predict(program, "flow_downsample");
+			predict.setArg(0, downsampled ? m_vectors[0] : m_vectors[topLevel]);
+			predict.setArg(1, m_prediction);
+			predict.setArg(2, downsampled ? (std::int32_t)(1 << topLevel) : 1);
+
+			m_predictionNode = addTunedKernel(graph, tuning, "flow_downsample", predict, dimension, {});
+			graph.setEnabled(m_predictionNode, false);
+		}
 
 		for (int i = PYRAMID_HEIGHT - 1; i >= 0; --i)
 		{
 			auto& dimension = first.getDimension(i);
-			m_vectors[i] = createImage(context, OUTPUT_MEMORY_FLAGS, FLOW_VECTOR_FORMAT, dimension);
 
+			cl::Kernel calcFlow(program, flowKernelName(sampling));
 			calcFlow.setArg(0, first.getImage(i));
 			calcFlow.setArg(1, derivativeX.getDerivative(i));
 			calcFlow.setArg(2, derivativeY.getDerivative(i));
 			calcFlow.setArg(3, matrixG.getMatrix(i));
-			calcFlow.setArg(4, second.getImage(i));
-			calcFlow.setArg(5, (i == PYRAMID_HEIGHT - 1) ? 0 : 1);
-			calcFlow.setArg(6, (i == PYRAMID_HEIGHT - 1) ? m_vectors[i] : m_vectors[i + 1]);
+			if (samplesBuffers(sampling))
+				calcFlow.setArg(4, second.getBuffer(i));
+			else
+				calcFlow.setArg(4, second.getImage(i));
 			calcFlow.setArg(7, m_vectors[i]);
 			calcFlow.setArg(8, (std::int32_t)dimension[0]);
 			calcFlow.setArg(9, (std::int32_t)dimension[1]);
-			
-			waitEvents[0] = matrixG.getFinished(i);
+			calcFlow.setArg(11, m_iterations[i]);
+			m_kernels[i] = calcFlow;
+			bindGuess(i);
+
+			std::vector<LaunchGraph::Node> dependencies;
+			dependencies.push_back(matrixG.getFinishedNode(i));
+			dependencies.push_back(samplesBuffers(sampling) ? second.getBufferFinishedNode(i) : second.getFinishedNode(i));
 			if (i != PYRAMID_HEIGHT - 1)
-			{
-				waitEvents.resize(2);
-				waitEvents[1] = m_finished[i + 1];
-			}
+				dependencies.push_back(m_finished[i + 1]);
+			if (i == topLevel && m_predictionNode != LaunchGraph::NO_NODE)
+				dependencies.push_back(m_predictionNode);
+
+			// The local size has to match LOCAL_X and LOCAL_Y the program was built with
+			auto& tileSize = tuning.getTileSize();
+			m_finished[i] = graph.addKernel(flowKernelName(sampling), calcFlow, roundUp(dimension, tileSize), tileSize, dependencies);
+		}
+	}
 
-			auto localWorkSize = cl::NDRange(16, 8);
-			auto globalWorkSize = cl::NDRange(localWorkSize[0] * DivUp(dimension[0], localWorkSize[0]),
-				localWorkSize[1] * DivUp(dimension[1], localWorkSize[1]));
+	// Starts the next replay at the predicted top level with the prediction from the previous
+	// pair as guess and fewer iterations, or runs the full pyramid from zero motion.
+	void setPredicted(bool predicted)
+	{
+		if (predicted == m_predicted || m_predictionNode == LaunchGraph::NO_NODE)
+			return;
 
-			queue.enqueueNDRangeKernel(calcFlow, cl::NullRange, globalWorkSize, localWorkSize, &waitEvents, &m_finished[i]);
+		m_predicted = predicted;
+		m_graph->setEnabled(m_predictionNode, predicted);
+		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
+		{
+			m_graph->setEnabled(m_finished[i], i <= getTopLevel());
+			bindGuess(i);
 		}
 	}
 
-	cl::Image2D const& getVector(std::size_t level) const { return m_vectors[level]; }
+	bool isPredicted() const { return m_predicted; }
 
-	cl::Event const& getFinished(std::size_t level) const { return m_finished[level]; }
+	std::size_t getTopLevel() const { return m_predicted ? m_temporal.predictedTopLevel : PYRAMID_HEIGHT - 1; }
 
-	void writeProfile(std::ostream& out, std::string const& baseName, cl_ulong baseCounter)
+	std::int32_t getIterationLimit() const { return m_predicted ? m_temporal.predictedIterations : m_temporal.fullIterations; }
+
+	cl::Image2D const& getVector(std::size_t level) const override { return m_vectors[level]; }
+
+	// Iterations per pixel of the last replay, only valid for levels up to getTopLevel()
+	cl::Image2D const& getIterations(std::size_t level) const { return m_iterations[level]; }
+
+	LaunchGraph::Node getFinishedNode(std::size_t level) const override { return m_finished[level]; }
+
+	cl::Event const& getFinished(std::size_t level) const override { return m_graph->getEvent(m_finished[level]); }
+
+	void writeProfile(std::ostream& out, std::string const& baseName, cl_ulong baseCounter) override
 	{
-		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
+		if (m_predicted)
+			writeProfileInfo(out, m_graph->getEvent(m_predictionNode), baseName + " prediction", baseCounter);
+
+		for (std::size_t i = 0; i <= getTopLevel(); ++i)
 		{
 			writeProfileInfo(out, getFinished(i), baseName + " calc flow " + std::to_string(i), baseCounter);
 		}
 	}
 
 private:
+	void bindGuess(std::size_t level)
+	{
+		auto& kernel = m_kernels[level];
+		if (level < getTopLevel())
+		{
+			kernel.setArg(5, GUESS_PYRAMID);
+			kernel.setArg(6, m_vectors[level + 1]);
+		}
+		else if (m_predicted)
+		{
+			kernel.setArg(5, GUESS_TEMPORAL);
+			kernel.setArg(6, m_prediction);
+		}
+		else
+		{
+			// Not read without a guess
+			kernel.setArg(5, GUESS_NONE);
+			kernel.setArg(6, m_vectors[level]);
+		}
+		kernel.setArg(10, getIterationLimit());
+	}
+
+	LaunchGraph* m_graph;
+	TemporalOptions m_temporal;
+	bool m_predicted;
+
+	cl::Image2D m_prediction;
+	LaunchGraph::Node m_predictionNode;
+
+	std::array<cl::Kernel, PYRAMID_HEIGHT> m_kernels;
 	std::array<cl::Image2D, PYRAMID_HEIGHT> m_vectors;
-	std::array<cl::Event, PYRAMID_HEIGHT> m_finished;
+	std::array<cl::Image2D, PYRAMID_HEIGHT> m_iterations;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT> m_finished;
 };
 
-boost::gil::rgba8_pixel_t randColor()
-{
-	static std::mt19937 generator;
-	static std::uniform_int_distribution<int> distribution(0, 255);
-	int r = distribution(generator);
-	int g = distribution(generator);
-	int b = distribution(generator);
-	return boost::gil::rgba8_pixel_t(r, g, b, 255);
-}
+// Pyramid level whose flow is filtered and upsampled for the output
+const std::size_t FLOW_OUTPUT_LEVEL = 2;
 
-void drawLines(gil::rgb8_image_t& output, gil::gray8_image_t const& base, cl::Image2D const& vector, cl::CommandQueue const& queue, std::vector<cl::Event> const& waitEvents)
-{
-	boost::gil::copy_pixels(gil::color_converted_view<gil::rgb8_pixel_t>(const_view(base)), view(output));
-	//boost::gil::fill_pixels(view(output), gil::rgba8_pixel_t(0, 0, 0, 0));
-
-	// NOTE: vector ist 4x so klein wie Output
-	//  alle 32 Pixel in output soll ein Vektor angebracht werden
-	auto width = output.width();
-	auto height = output.height();
-	auto vectorWidth = width / 4;
-
-	std::default_random_engine generator(2);
-	auto outputView = view(output);
-	auto STEP_SIZE = 8;
-	for (int y = 1; y < height; y += STEP_SIZE)
-		for (int x = 1; x < width; x += STEP_SIZE)
-		{
-			auto mappedImage = mapImage(queue, vector, CL_MAP_READ, &waitEvents);
-			auto* mappedImageData = (float*)mappedImage.data;
-			auto vectorPosX = x / 4;
-			auto vectorPosY = y / 4;
-			auto vectorX = mappedImageData[(vectorPosY * vectorWidth + vectorPosX) * 2];
-			auto vectorY = mappedImageData[(vectorPosY * vectorWidth + vectorPosX) * 2 + 1];
-			//std::cout << "vector(" << vectorPosX << ", " << vectorPosY << "): " 
-			//	<< "(" << vectorX << ", " << vectorY << ")" << std::endl;
-			float length = std::roundf(vectorX * vectorX + vectorY * vectorY);
-			float unitX = (vectorX / length);
-			float unitY = (vectorY / length);
-			//auto color = randColor();
-			//outputView((int)std::roundf(x), (int)std::roundf(y)) = color;
-			float maxLength = 4 * length;
-			for (int i = 0; i <= (int)maxLength; i += 1)
-			{
-				int xPos = (int)std::roundf(x + i * unitX);
-				int yPos = (int)std::roundf(y + i * unitY);
-				int8_t colorValue = (int8_t)(i * 128.0f / maxLength);
-				if (xPos >= 0 && xPos < width && yPos >= 0 && yPos < height)
-				{
-					boost::gil::rgba8_pixel_t color(255, colorValue, 16, 255);
-					outputView(xPos, yPos) = color;
-				}
-			}
-		}
+// Has to match PATCH_SIZE and PATCH_STRIDE in optical-flow.cl
+const std::size_t PATCH_SIZE = 8;
+const std::size_t PATCH_STRIDE = 4;
+
+const std::int32_t PATCH_ITERATIONS = 8;
+
+// Number of patches in one dimension of a level, levels smaller than a patch have one patch
+inline std::size_t patchGridSize(std::size_t size)
+{
+	return (size >= PATCH_SIZE) ? (size - PATCH_SIZE) / PATCH_STRIDE + 1 : 1;
 }
 
-int main()
+// Dense flow from patch inverse search (dis_patch_search) and densification (dis_densify). Uses
+// the same image and Scharr pyramids as FlowPyramid, but no G matrices. J is sampled from the
+// buffer copies of the second pyramid. Every pair starts from zero motion at the coarsest level,
+// a temporal prediction is not supported.
+class PatchFlowPyramid : public FlowEstimator
 {
-	try
+public:
+	PatchFlowPyramid(cl::Context const& context, cl::Program const& program, LaunchGraph& graph, TuningTable const& tuning,
+		ImagePyramid const& first, ImagePyramid const& second,
+		ScharrPyramid const& derivativeX, ScharrPyramid const& derivativeY, TemporalOptions const& temporal)
+		: m_graph(&graph)
 	{
-		gil::gray8_image_t firstImage, secondImage;
-		loadImage(FIRST_IMAGE, firstImage);
-		loadImage(SECOND_IMAGE, secondImage);
-		if (firstImage.dimensions() != secondImage.dimensions())
+		if (temporal.prediction != TemporalPrediction::None)
+			throw std::invalid_argument("The temporal prediction is only supported by the Lucas-Kanade engine");
+		if (!second.hasBuffers())
+			throw std::runtime_error("Patch inverse search needs an image pyramid with buffers");
+
+		for (int i = PYRAMID_HEIGHT - 1; i >= 0; --i)
 		{
-			std::cout << "The images have different dimensions!\n";
-			return -1;
+			auto& dimension = first.getDimension(i);
+			cl::NDRange grid(patchGridSize(dimension[0]), patchGridSize(dimension[1]));
+			m_vectors[i] = createImage(context, OUTPUT_MEMORY_FLAGS, FLOW_VECTOR_FORMAT, dimension);
+			m_patches[i] = cl::Buffer(context, CL_MEM_READ_WRITE, grid[0] * grid[1] * sizeof(cl_float2));
+
+			bool coarsest = (i == PYRAMID_HEIGHT - 1);
+			cl::Kernel search(program, "dis_patch_search");
+			search.setArg(0, first.getImage(i));
+			search.setArg(1, derivativeX.getDerivative(i));
+			search.setArg(2, derivativeY.getDerivative(i));
+			search.setArg(3, second.getBuffer(i));
+			search.setArg(4, coarsest ? GUESS_NONE : GUESS_PYRAMID);
+			search.setArg(5, coarsest ? m_vectors[i] : m_vectors[i + 1]);
+			search.setArg(6, m_patches[i]);
+			search.setArg(7, (std::int32_t)grid[0]);
+			search.setArg(8, (std::int32_t)grid[1]);
+			search.setArg(9, (std::int32_t)dimension[0]);
+			search.setArg(10, (std::int32_t)dimension[1]);
+			search.setArg(11, PATCH_ITERATIONS);
+
+			std::vector<LaunchGraph::Node> dependencies;
+			dependencies.push_back(first.getFinishedNode(i));
+			dependencies.push_back(derivativeX.getFinishedNode(i));
+			dependencies.push_back(derivativeY.getFinishedNode(i));
+			dependencies.push_back(second.getBufferFinishedNode(i));
+			if (!coarsest)
+				dependencies.push_back(m_finished[i + 1]);
+			m_searchNodes[i] = addTunedKernel(graph, tuning, "dis_patch_search", search, grid, dependencies);
+
+			cl::Kernel densify(program, "dis_densify");
+			densify.setArg(0, first.getImage(i));
+			densify.setArg(1, second.getBuffer(i));
+			densify.setArg(2, m_patches[i]);
+			densify.setArg(3, m_vectors[i]);
+			densify.setArg(4, (std::int32_t)grid[0]);
+			densify.setArg(5, (std::int32_t)grid[1]);
+			m_finished[i] = addTunedKernel(graph, tuning, "dis_densify", densify, dimension, { m_searchNodes[i] });
 		}
+	}
 
-		auto platform = choosePlatform();
-		auto device = chooseDevice(platform, CL_DEVICE_TYPE_ALL);
+	cl::Image2D const& getVector(std::size_t level) const override { return m_vectors[level]; }
 
-		cl::Context context(device);
-		cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	LaunchGraph::Node getFinishedNode(std::size_t level) const override { return m_finished[level]; }
 
-		auto program = buildProgram(context, device, PROGRAM_FILE);
-		cl::Kernel downFilterX(program, "downfilter_x");
-		cl::Kernel downFilterY(program, "downfilter_y");
-		cl::Kernel filterG(program, "filter_G");
-		cl::Kernel scharrHorX(program, "scharr_x_horizontal");
-		cl::Kernel scharrVerX(program, "scharr_x_vertical");
-		cl::Kernel scharrHorY(program, "scharr_y_horizontal");
-		cl::Kernel scharrVerY(program, "scharr_y_vertical");
-		cl::Kernel calcFlow(program, "optical_flow_2");
+	cl::Event const& getFinished(std::size_t level) const override { return m_graph->getEvent(m_finished[level]); }
 
-		cl::ImageFormat format(CL_R, CL_UNSIGNED_INT8);
-		std::size_t widthLevel0 = firstImage.width();
-		std::size_t heightLevel0 = firstImage.height();
+	void writeProfile(std::ostream& out, std::string const& baseName, cl_ulong baseCounter) override
+	{
+		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
+		{
+			writeProfileInfo(out, m_graph->getEvent(m_searchNodes[i]), baseName + " patch search " + std::to_string(i), baseCounter);
+			writeProfileInfo(out, getFinished(i), baseName + " densify " + std::to_string(i), baseCounter);
+		}
+	}
 
-		Timer timer;
-		timer.start();
+private:
+	LaunchGraph* m_graph;
 
-		ImagePyramid firstImagePyramid(firstImage, context, queue, downFilterX, downFilterY);
-		ImagePyramid secondImagePyramid(secondImage, context, queue, downFilterX, downFilterY);
-		ScharrPyramid derivativeX(context, queue, scharrHorX, scharrVerX, firstImagePyramid);
-		ScharrPyramid derivativeY(context, queue, scharrHorY, scharrVerY, firstImagePyramid);
+	std::array<cl::Image2D, PYRAMID_HEIGHT> m_vectors;
+	std::array<cl::Buffer, PYRAMID_HEIGHT> m_patches;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT> m_searchNodes;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT> m_finished;
+};
 
-		GMatrixPyramid matrixG(context, queue, filterG, derivativeX, derivativeY);
-		FlowPyramid flow(context, queue, calcFlow,
-			firstImagePyramid, secondImagePyramid, derivativeX, derivativeY, matrixG);
+struct FlowFilterOptions
+{
+	// 0 disables the median filter, 1 is 3x3 and 2 is 5x5
+	int medianRadius;
+	bool bilateral;
+	float sigmaSpace;
+	float sigmaColor;
+	std::size_t level;
+};
 
-		for (int i = 0; i < 3; ++i)
-		{
-			auto& image = firstImagePyramid.getImage(i);
-			saveImage(queue, image, "output/first-scaled-" + std::to_string(i) + ".jpg", { firstImagePyramid.getFinished(i) });
-		}
+const FlowFilterOptions DEFAULT_FLOW_FILTER = { 1, true, 2.0f, 12.0f, FLOW_OUTPUT_LEVEL };
 
-		for (int i = 0; i < 3; ++i)
-		{
-			auto& image = secondImagePyramid.getImage(i);
-			saveImage(queue, image, "output/second-scaled-" + std::to_string(i) + ".jpg", { firstImagePyramid.getFinished(i) });
-		}
+// Post processing of one level of the flow pyramid: optional vector median, optional
+// bilateral smoothing guided by the first image and bilinear upsampling to the resolution
+// of level 0. The stages are chained after the flow of the level is finished.
+class FlowPostProcess
+{
+public:
+	FlowPostProcess(cl::Context const& context, cl::Program const& program, LaunchGraph& graph, TuningTable const& tuning,
+		ImagePyramid const& first, FlowEstimator const& flow, std::size_t level, FlowFilterOptions const& options)
+		: m_graph(&graph), m_output(flow.getVector(level)), m_finished(flow.getFinishedNode(level)),
+		m_medianNode(LaunchGraph::NO_NODE), m_bilateralNode(LaunchGraph::NO_NODE), m_upsampleNode(LaunchGraph::NO_NODE)
+	{
+		auto& dimension = first.getDimension(level);
 
-		for (int i = 0; i < 3; ++i)
+		if (options.medianRadius > 0)
 		{
-			auto& image = derivativeX.getDerivative(i);
-			saveScharrImage(queue, image, "output/scharr-x-" + std::to_string(i) + ".jpg", { derivativeX.getFinished(i) });
+			m_median = createImage(context, INTERMEDIATE_MEMORY_FLAGS, FLOW_VECTOR_FORMAT, dimension);
+			cl::Kernel median(program, "flow_median");
+			median.setArg(0, m_output);
+			median.setArg(1, m_median);
+			median.setArg(2, (std::int32_t)options.medianRadius);
+
+			auto& tileSize = tuning.getTileSize();
+			m_medianNode = graph.addKernel("flow_median", median, roundUp(dimension, tileSize), tileSize, { m_finished });
+			m_output = m_median;
+			m_finished = m_medianNode;
 		}
 
-		for (int i = 0; i < 3; ++i)
+		if (options.bilateral)
 		{
-			auto& image = derivativeY.getDerivative(i);
-			saveScharrImage(queue, image, "output/scharr-y-" + std::to_string(i) + ".jpg", { derivativeY.getFinished(i) });
+			m_bilateral = createImage(context, INTERMEDIATE_MEMORY_FLAGS, FLOW_VECTOR_FORMAT, dimension);
+			cl::Kernel bilateral(program, "flow_bilateral");
+			bilateral.setArg(0, m_output);
+			bilateral.setArg(1, first.getImage(level));
+			bilateral.setArg(2, m_bilateral);
+			bilateral.setArg(3, options.sigmaSpace);
+			bilateral.setArg(4, options.sigmaColor);
+
+			m_bilateralNode = addTunedKernel(graph, tuning, "flow_bilateral", bilateral, dimension, { m_finished });
+			m_output = m_bilateral;
+			m_finished = m_bilateralNode;
 		}
 
-		for (int i = 0; i < 3; ++i)
+		if (level > 0)
 		{
-			auto& image = matrixG.getMatrix(i);
-			saveGMatrix(queue, image, "output/g-matrix-0-" + std::to_string(i) + ".jpg", { matrixG.getFinished(i) }, 0);
-			saveGMatrix(queue, image, "output/g-matrix-1-" + std::to_string(i) + ".jpg", { matrixG.getFinished(i) }, 1);
-			saveGMatrix(queue, image, "output/g-matrix-2-" + std::to_string(i) + ".jpg", { matrixG.getFinished(i) }, 2);
-			saveGMatrix(queue, image, "output/g-matrix-3-" + std::to_string(i) + ".jpg", { matrixG.getFinished(i) }, 3);
+			auto& fullDimension = first.getDimension(0);
+			m_upsampled = createImage(context, OUTPUT_MEMORY_FLAGS, FLOW_VECTOR_FORMAT, fullDimension);
+			cl::Kernel upsample(program, "flow_upsample");
+			upsample.setArg(0, m_output);
+			upsample.setArg(1, m_upsampled);
+			upsample.setArg(2, (float)(1 << level));
+
+			m_upsampleNode = addTunedKernel(graph, tuning, "flow_upsample", upsample, fullDimension, { m_finished });
+			m_output = m_upsampled;
+			m_finished = m_upsampleNode;
 		}
+	}
 
-		for (int i = 0; i < 3; ++i)
-		{
-			auto& image = flow.getVector(i);
-			saveFlow(queue, image, "output/flow-x-" + std::to_string(i) + ".jpg", { flow.getFinished(i) }, 0);
-			saveFlow(queue, image, "output/flow-y-" + std::to_string(i) + ".jpg", { flow.getFinished(i) }, 1);
-		}
+	// Flow at the resolution of level 0
+	cl::Image2D const& getOutput() const { return m_output; }
 
-		boost::gil::rgb8_image_t withLines(firstImage.width(), firstImage.height());
-		drawLines(withLines, firstImage, flow.getVector(2), queue, { flow.getFinished(2) });
-		jpeg_write_view("output/lines.jpeg", view(withLines));
+	LaunchGraph::Node getFinishedNode() const { return m_finished; }
 
-		boost::gil::rgb8_image_t withLines2(firstImage.width(), firstImage.height());
-		drawLines(withLines2, secondImage, flow.getVector(2), queue, { flow.getFinished(2) });
-		jpeg_write_view("output/lines2.jpeg", view(withLines2));
+	cl::Event const& getFinished() const { return m_graph->getEvent(m_finished); }
 
+	void writeProfile(std::ostream& out, std::string const& baseName, cl_ulong baseCounter)
+	{
+		if (m_medianNode != LaunchGraph::NO_NODE)
+			writeProfileInfo(out, m_graph->getEvent(m_medianNode), baseName + " median", baseCounter);
+		if (m_bilateralNode != LaunchGraph::NO_NODE)
+			writeProfileInfo(out, m_graph->getEvent(m_bilateralNode), baseName + " bilateral", baseCounter);
+		if (m_upsampleNode != LaunchGraph::NO_NODE)
+			writeProfileInfo(out, m_graph->getEvent(m_upsampleNode), baseName + " upsample", baseCounter);
+	}
 
-		queue.finish();
-		timer.stop("down_filter_all");
+private:
+	LaunchGraph* m_graph;
 
-		std::ofstream out("profile.csv");
+	cl::Image2D m_output;
+	LaunchGraph::Node m_finished;
 
-		auto baseCounter = firstImagePyramid.getFinished(0).getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+	cl::Image2D m_median;
+	cl::Image2D m_bilateral;
+	cl::Image2D m_upsampled;
+	LaunchGraph::Node m_medianNode;
+	LaunchGraph::Node m_bilateralNode;
+	LaunchGraph::Node m_upsampleNode;
+};
 
-		out << ";Not Existing;Queued;Submitted;Running\n";
+// Pixel type of an image for the reduction and rendering kernels, PIXEL_* in optical-flow.cl
+enum class PixelType : std::int32_t
+{
+	Unsigned = 0,
+	Signed = 1,
+	Float = 2
+};
+
+// Length of the first two channels, e.g. the magnitude of the flow vectors
+const std::int32_t MAGNITUDE_CHANNEL = 4;
+
+// Has to match REDUCE_SIZE and HISTOGRAM_BINS in optical-flow.cl
+const std::size_t REDUCE_SIZE = 256;
+const std::size_t REDUCE_GROUPS = 64;
+const std::size_t HISTOGRAM_BINS = 64;
+
+// Layout of the float4 written by reduce_stats_final
+struct ImageStats
+{
+	float minimum;
+	float maximum;
+	float sum;
+	float count;
+
+	float mean() const { return (count > 0.0f) ? sum / count : 0.0f; }
+};
+
+// Min, max, sum and a histogram of one channel of an image computed on the device. The results
+// stay in device buffers, so kernels can use them without a readback (e.g. to normalize). The
+// reduction is either added to a launch graph or enqueued directly.
+class DeviceReduction
+{
+public:
+	DeviceReduction(cl::Context const& context, cl::Program const& program, cl::Image2D const& image, PixelType type, std::int32_t channel)
+		: m_partial(context, CL_MEM_READ_WRITE, REDUCE_GROUPS * sizeof(cl_float4))
+		, m_stats(context, CL_MEM_READ_WRITE, sizeof(cl_float4))
+		, m_histogram(context, CL_MEM_READ_WRITE, HISTOGRAM_BINS * sizeof(cl_uint))
+		, m_reduce(program, "reduce_stats")
+		, m_reduceFinal(program, "reduce_stats_final")
+		, m_clearHistogram(program, "histogram_clear")
+		, m_fillHistogram(program, "histogram")
+	{
+		m_reduce.setArg(0, image);
+		m_reduce.setArg(1, (std::int32_t)type);
+		m_reduce.setArg(2, channel);
+		m_reduce.setArg(3, m_partial);
+
+		m_reduceFinal.setArg(0, m_partial);
+		m_reduceFinal.setArg(1, (std::int32_t)REDUCE_GROUPS);
+		m_reduceFinal.setArg(2, m_stats);
+
+		m_clearHistogram.setArg(0, m_histogram);
+
+		m_fillHistogram.setArg(0, image);
+		m_fillHistogram.setArg(1, (std::int32_t)type);
+		m_fillHistogram.setArg(2, channel);
+		m_fillHistogram.setArg(3, m_stats);
+		m_fillHistogram.setArg(4, m_histogram);
+	}
+
+	LaunchGraph::Node addToGraph(LaunchGraph& graph, std::vector<LaunchGraph::Node> const& dependencies)
+	{
+		auto reduced = graph.addKernel("reduce_stats", m_reduce, cl::NDRange(REDUCE_GROUPS * REDUCE_SIZE), cl::NDRange(REDUCE_SIZE), dependencies);
+		auto combined = graph.addKernel("reduce_stats_final", m_reduceFinal, cl::NDRange(REDUCE_SIZE), cl::NDRange(REDUCE_SIZE), { reduced });
+		auto cleared = graph.addKernel("histogram_clear", m_clearHistogram, cl::NDRange(HISTOGRAM_BINS), cl::NullRange, {});
+		return graph.addKernel("histogram", m_fillHistogram, cl::NDRange(REDUCE_GROUPS * REDUCE_SIZE), cl::NDRange(REDUCE_SIZE), { combined, cleared });
+	}
+
+	// Returns the event of the histogram, the stats are finished before
+	cl::Event enqueue(cl::CommandQueue const& queue, std::vector<cl::Event> const& waitEvents)
+	{
+		cl::Event reduced, combined, cleared, histogram;
+		queue.enqueueNDRangeKernel(m_reduce, cl::NullRange, cl::NDRange(REDUCE_GROUPS * REDUCE_SIZE), cl::NDRange(REDUCE_SIZE), &waitEvents, &reduced);
+		std::vector<cl::Event> finalWaits = { reduced };
+		queue.enqueueNDRangeKernel(m_reduceFinal, cl::NullRange, cl::NDRange(REDUCE_SIZE), cl::NDRange(REDUCE_SIZE), &finalWaits, &combined);
+		queue.enqueueNDRangeKernel(m_clearHistogram, cl::NullRange, cl::NDRange(HISTOGRAM_BINS), cl::NullRange, nullptr, &cleared);
+
+		std::vector<cl::Event> histogramWaits = { combined, cleared };
+		queue.enqueueNDRangeKernel(m_fillHistogram, cl::NullRange, cl::NDRange(REDUCE_GROUPS * REDUCE_SIZE), cl::NDRange(REDUCE_SIZE), &histogramWaits, &histogram);
+		return histogram;
+	}
+
+	// float4 (min, max, sum, count)
+	cl::Buffer const& getStats() const { return m_stats; }
+
+	// HISTOGRAM_BINS counts over [min, max]
+	cl::Buffer const& getHistogram() const { return m_histogram; }
+
+	ImageStats readStats(cl::CommandQueue const& queue, std::vector<cl::Event> const& waitEvents) const
+	{
+		ImageStats stats;
+		queue.enqueueReadBuffer(m_stats, CL_TRUE, 0, sizeof(stats), &stats, &waitEvents);
+		return stats;
+	}
+
+	std::vector<cl_uint> readHistogram(cl::CommandQueue const& queue, std::vector<cl::Event> const& waitEvents) const
+	{
+		std::vector<cl_uint> bins(HISTOGRAM_BINS);
+		queue.enqueueReadBuffer(m_histogram, CL_TRUE, 0, bins.size() * sizeof(cl_uint), bins.data(), &waitEvents);
+		return bins;
+	}
+
+private:
+	cl::Buffer m_partial;
+	cl::Buffer m_stats;
+	cl::Buffer m_histogram;
+	cl::Kernel m_reduce;
+	cl::Kernel m_reduceFinal;
+	cl::Kernel m_clearHistogram;
+	cl::Kernel m_fillHistogram;
+};
+
+// Value below which the given fraction of the pixels lies, from a histogram over [min, max]
+float histogramPercentile(std::vector<cl_uint> const& bins, ImageStats const& stats, float fraction)
+{
+	std::uint64_t total = 0;
+	for (auto count : bins)
+		total += count;
+
+	std::uint64_t sum = 0;
+	for (std::size_t i = 0; i < bins.size(); ++i)
+	{
+		sum += bins[i];
+		if (sum >= fraction * total)
+			return stats.minimum + (stats.maximum - stats.minimum) * (i + 1) / bins.size();
+	}
+	return stats.maximum;
+}
+
+// Complete flow pipeline for one frame size. All images are allocated and all kernel arguments
+// are bound once in the constructor, process() only uploads the frames and replays the launch
+// graph. A session owns its kernel instances, so one session per thread can run concurrently
+// as long as every thread uses its own session (the context and program may be shared).
+class FlowSession
+{
+public:
+	FlowSession(cl::Context const& context, cl::Program const& program, TuningTable const& tuning,
+		std::size_t width, std::size_t height, FlowFilterOptions const& filter,
+		TemporalOptions const& temporal = NO_TEMPORAL_PREDICTION, FlowEngine engine = FLOW_ENGINE, FlowSampling sampling = FLOW_SAMPLING)
+		: m_first(context, program, m_graph, tuning, width, height)
+		, m_second(context, program, m_graph, tuning, width, height, samplesBuffers(sampling) || engine == FlowEngine::PatchInverseSearch)
+		, m_derivativeX(context, program, m_graph, tuning, "scharr_x_horizontal", "scharr_x_vertical", m_first)
+		, m_derivativeY(context, program, m_graph, tuning, "scharr_y_horizontal", "scharr_y_vertical", m_first)
+		, m_matrixG((engine == FlowEngine::LucasKanade) ? new GMatrixPyramid(context, program, m_graph, tuning, m_derivativeX, m_derivativeY) : nullptr)
+		, m_lucasKanade((engine == FlowEngine::LucasKanade)
+			? new FlowPyramid(context, program, m_graph, tuning, m_first, m_second, m_derivativeX, m_derivativeY, *m_matrixG, sampling, temporal)
+			: nullptr)
+		, m_patchFlow((engine == FlowEngine::PatchInverseSearch)
+			? new PatchFlowPyramid(context, program, m_graph, tuning, m_first, m_second, m_derivativeX, m_derivativeY, temporal)
+			: nullptr)
+		, m_output(context, program, m_graph, tuning, m_first, getFlowPyramid(), filter.level, filter)
+		, m_motion(context, program, m_output.getOutput(), PixelType::Float, MAGNITUDE_CHANNEL)
+		, m_temporal(temporal), m_countIterations(temporal.prediction != TemporalPrediction::None), m_predictionGood(false)
+		, m_iterationStats(), m_iterationCounts(context, CL_MEM_READ_WRITE, 2 * PYRAMID_HEIGHT * sizeof(cl_uint))
+		, m_clearCounts(program, "histogram_clear"), m_clearNode(LaunchGraph::NO_NODE), m_countPending(false)
+		, m_countedPredicted(false), m_countedTopLevel(0)
+		, m_frames(0), m_uploadTime(clock_t::duration::zero()), m_enqueueTime(clock_t::duration::zero())
+	{
+		if (temporal.prediction != TemporalPrediction::None && temporal.predictedTopLevel < filter.level)
+			throw std::invalid_argument("The output level is skipped when the temporal prediction is used");
+
+		m_motionFinished = m_motion.addToGraph(m_graph, { m_output.getFinishedNode() });
+
+		if (m_lucasKanade)
+		{
+			m_clearCounts.setArg(0, m_iterationCounts);
+			m_clearNode = m_graph.addKernel("histogram_clear", m_clearCounts, cl::NDRange(2 * PYRAMID_HEIGHT), cl::NullRange, {});
+			for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
+			{
+				m_countKernels[i] = cl::Kernel(program, "count_iterations");
+				m_countKernels[i].setArg(0, m_lucasKanade->getIterations(i));
+				m_countKernels[i].setArg(2, (std::int32_t)i);
+				m_countKernels[i].setArg(3, m_iterationCounts);
+				m_countNodes[i] = m_graph.addKernel("count_iterations", m_countKernels[i], cl::NDRange(REDUCE_GROUPS * REDUCE_SIZE), cl::NDRange(REDUCE_SIZE),
+					{ m_lucasKanade->getFinishedNode(i), m_clearNode });
+			}
+		}
+	}
+
+	// The pending read of the iteration counts writes into m_countData
+	~FlowSession()
+	{
+		if (m_countPending)
+			m_countRead.wait();
+	}
+
+	// The pyramids keep a pointer to the graph
+	FlowSession(FlowSession const&) = delete;
+	FlowSession& operator = (FlowSession const&) = delete;
+
+	// Uploads the frame pair and enqueues the launch graph. Does not wait for the result, the
+	// frames are read by the device and have to stay unchanged until getFinished() completes.
+	// With a temporal prediction the pairs have to be consecutive frames of one sequence.
+	void process(cl::CommandQueue const& queue, InputImage const& first, InputImage const& second)
+	{
+		// Iteration counts of the previous pair decide whether its prediction can be trusted,
+		// without a prediction they are collected after this replay was enqueued
+		if (m_temporal.prediction != TemporalPrediction::None)
+			collectIterations();
+		bool predicted = m_temporal.prediction != TemporalPrediction::None && m_frames > 0 && m_predictionGood;
+		if (m_lucasKanade)
+		{
+			m_lucasKanade->setPredicted(predicted);
+			bindIterationCounts();
+		}
+
+		auto start = clock_t::now();
+		m_first.upload(queue, first);
+		m_second.upload(queue, second);
+
+		auto uploaded = clock_t::now();
+		m_graph.replay(queue);
+		queue.flush();
+
+		auto end = clock_t::now();
+		m_uploadTime += uploaded - start;
+		m_enqueueTime += end - uploaded;
+		++m_frames;
+
+		if (m_countIterations)
+		{
+			// The read of the previous pair comes before this replay in the in-order queue, so
+			// waiting for it does not stall the device
+			collectIterations();
+			readIterations(queue);
+			queue.flush();
+		}
+	}
+
+	// Flow at the resolution of level 0 after the post processing
+	cl::Image2D const& getFlow() const { return m_output.getOutput(); }
+
+	cl::Event const& getFinished() const { return m_output.getFinished(); }
+
+	// Magnitude stats (min, max, sum, count) and histogram of the output flow of every pair.
+	// They stay on the device, e.g. render_flow_color normalizes with the stats buffer.
+	cl::Buffer const& getMotionStats() const { return m_motion.getStats(); }
+
+	cl::Buffer const& getMotionHistogram() const { return m_motion.getHistogram(); }
+
+	cl::Event const& getMotionFinished() const { return m_graph.getEvent(m_motionFinished); }
+
+	ImageStats readMotionStats(cl::CommandQueue const& queue) const { return m_motion.readStats(queue, { getMotionFinished() }); }
+
+	std::vector<cl_uint> readMotionHistogram(cl::CommandQueue const& queue) const { return m_motion.readHistogram(queue, { getMotionFinished() }); }
+
+	ImagePyramid const& getFirstPyramid() const { return m_first; }
+	ImagePyramid const& getSecondPyramid() const { return m_second; }
+	ScharrPyramid const& getDerivativeX() const { return m_derivativeX; }
+	ScharrPyramid const& getDerivativeY() const { return m_derivativeY; }
+	// Only used by the Lucas-Kanade engine, null otherwise
+	GMatrixPyramid const* getMatrixG() const { return m_matrixG.get(); }
+
+	FlowEstimator const& getFlowPyramid() const
+	{
+		return m_lucasKanade ? static_cast<FlowEstimator const&>(*m_lucasKanade) : *m_patchFlow;
+	}
+
+	LaunchGraph const& getGraph() const { return m_graph; }
+
+	// Sums of the flow iterations per level over all processed pairs. The iteration images are
+	// summed on the device and only two values per level are read back after every pair.
+	// Counting is always enabled with a temporal prediction.
+	struct IterationStats
+	{
+		std::size_t frames;
+		std::size_t predictedFrames;
+		std::array<std::uint64_t, PYRAMID_HEIGHT> iterations;
+		std::array<std::uint64_t, PYRAMID_HEIGHT> pixels;
+		std::array<std::uint64_t, PYRAMID_HEIGHT> saturated;
+	};
+
+	void countIterations(bool enable) { m_countIterations = m_lucasKanade && (enable || m_temporal.prediction != TemporalPrediction::None); }
+
+	// Waits for the iteration counts of the last pair
+	IterationStats const& getIterationStats()
+	{
+		collectIterations();
+		return m_iterationStats;
+	}
+
+	void writeIterationStats(std::ostream& out)
+	{
+		auto& stats = getIterationStats();
+		out << "[Session]: " << stats.frames << " pairs, " << stats.predictedFrames << " predicted";
+		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
+		{
+			if (stats.pixels[i] == 0)
+				continue;
+			out << ", level " << i << ": " << (double)stats.iterations[i] / stats.pixels[i] << " iterations/pixel";
+		}
+		out << "\n";
+	}
+
+	// Host time per frame for enqueueing the frame uploads and the launch graph
+	void writeHostTimes(std::ostream& out) const
+	{
+		if (m_frames == 0)
+			return;
+
+		auto uploadInUs = std::chrono::duration_cast<std::chrono::microseconds>(m_uploadTime).count() / m_frames;
+		auto enqueueInUs = std::chrono::duration_cast<std::chrono::microseconds>(m_enqueueTime).count() / m_frames;
+		out << "[Session]: " << m_frames << " frames, " << m_graph.getLaunchCount() << " commands per frame, "
+			<< "upload " << uploadInUs << " us, enqueue " << enqueueInUs << " us per frame\n";
+	}
+
+	void writeProfile(std::ostream& out, cl_ulong baseCounter)
+	{
+		m_first.writeProfile(out, "image 1", baseCounter);
+		m_second.writeProfile(out, "image 2", baseCounter);
+		m_derivativeX.writeProfile(out, "X", baseCounter);
+		m_derivativeY.writeProfile(out, "Y", baseCounter);
+		if (m_matrixG)
+			m_matrixG->writeProfile(out, "matrix", baseCounter);
+		flowEstimator().writeProfile(out, "optical", baseCounter);
+		m_output.writeProfile(out, "post", baseCounter);
+	}
+
+private:
+	typedef std::chrono::steady_clock clock_t;
+
+	FlowEstimator& flowEstimator()
+	{
+		return m_lucasKanade ? static_cast<FlowEstimator&>(*m_lucasKanade) : *m_patchFlow;
+	}
+
+	// Counts the levels the next replay computes with the iteration limit it uses
+	void bindIterationCounts()
+	{
+		auto& flow = *m_lucasKanade;
+		m_graph.setEnabled(m_clearNode, m_countIterations);
+		for (std::size_t i = 0; i < PYRAMID_HEIGHT; ++i)
+		{
+			bool enabled = m_countIterations && i <= flow.getTopLevel();
+			m_graph.setEnabled(m_countNodes[i], enabled);
+			if (enabled)
+				m_countKernels[i].setArg(1, flow.getIterationLimit());
+		}
+	}
+
+	// Non-blocking read of the iteration counts of all computed levels
+	void readIterations(cl::CommandQueue const& queue)
+	{
+		auto& flow = *m_lucasKanade;
+		std::vector<cl::Event> waitEvents;
+		for (std::size_t i = 0; i <= flow.getTopLevel(); ++i)
+			waitEvents.push_back(m_graph.getEvent(m_countNodes[i]));
+		queue.enqueueReadBuffer(m_iterationCounts, CL_FALSE, 0, sizeof(m_countData), m_countData.data(), &waitEvents, &m_countRead);
+		m_countPending = true;
+		m_countedPredicted = flow.isPredicted();
+		m_countedTopLevel = flow.getTopLevel();
+	}
+
+	void collectIterations()
+	{
+		if (!m_countPending)
+			return;
+
+		m_countRead.wait();
+		m_countPending = false;
+
+		for (std::size_t i = 0; i <= m_countedTopLevel; ++i)
+		{
+			auto& dimension = m_first.getDimension(i);
+			std::uint64_t pixels = dimension[0] * dimension[1];
+			std::uint64_t saturated = m_countData[2 * i + 1];
+			m_iterationStats.iterations[i] += m_countData[2 * i];
+			m_iterationStats.pixels[i] += pixels;
+			m_iterationStats.saturated[i] += saturated;
+
+			// A failed prediction needs more iterations at the top level than it was given
+			if (i == m_countedTopLevel)
+			{
+				float saturatedFraction = (float)saturated / pixels;
+				m_predictionGood = !m_countedPredicted || saturatedFraction <= m_temporal.maxSaturatedFraction;
+			}
+		}
+
+		++m_iterationStats.frames;
+		if (m_countedPredicted)
+			++m_iterationStats.predictedFrames;
+	}
+
+	LaunchGraph m_graph;
+	ImagePyramid m_first;
+	ImagePyramid m_second;
+	ScharrPyramid m_derivativeX;
+	ScharrPyramid m_derivativeY;
+	std::unique_ptr<GMatrixPyramid> m_matrixG;
+	std::unique_ptr<FlowPyramid> m_lucasKanade;
+	std::unique_ptr<PatchFlowPyramid> m_patchFlow;
+	FlowPostProcess m_output;
+	DeviceReduction m_motion;
+	LaunchGraph::Node m_motionFinished;
+
+	TemporalOptions m_temporal;
+	bool m_countIterations;
+	bool m_predictionGood;
+	IterationStats m_iterationStats;
+	// (iterations, pixels which did not converge) per level of the last counted pair
+	cl::Buffer m_iterationCounts;
+	cl::Kernel m_clearCounts;
+	LaunchGraph::Node m_clearNode;
+	std::array<cl::Kernel, PYRAMID_HEIGHT> m_countKernels;
+	std::array<LaunchGraph::Node, PYRAMID_HEIGHT> m_countNodes;
+	std::array<cl_uint, 2 * PYRAMID_HEIGHT> m_countData;
+	cl::Event m_countRead;
+	bool m_countPending;
+	bool m_countedPredicted;
+	std::size_t m_countedTopLevel;
+
+	std::size_t m_frames;
+	clock_t::duration m_uploadTime;
+	clock_t::duration m_enqueueTime;
+};
+
+// Debug images are rendered on the device into tightly packed 8 bit RGB, only that crosses the bus
+void saveRgbBuffer(cl::CommandQueue const& queue, cl::Buffer const& source, std::size_t width, std::size_t height,
+	std::string const& targetFile, std::vector<cl::Event> const& waitEvents)
+{
+	gil::rgb8_image_t image(width, height);
+	auto* data = gil::interleaved_view_get_raw_data(view(image));
+	queue.enqueueReadBuffer(source, CL_TRUE, 0, width * height * 3, data, &waitEvents);
+	jpeg_write_view(targetFile, view(image));
+}
+
+cl::Buffer createRgbBuffer(cl::Context const& context, cl::NDRange const& dimension)
+{
+	return cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, dimension[0] * dimension[1] * 3);
+}
+
+cl::NDRange imageDimension(cl::Image2D const& image)
+{
+	return cl::NDRange(image.getImageInfo<CL_IMAGE_WIDTH>(), image.getImageInfo<CL_IMAGE_HEIGHT>());
+}
+
+// One channel of an image scaled from its min/max range to gray
+void saveNormalized(cl::Context const& context, cl::Program const& program, cl::CommandQueue const& queue,
+	cl::Image2D const& source, PixelType type, std::int32_t channel, std::string const& targetFile, std::vector<cl::Event> const& waitEvents)
+{
+	TimedEvent event("save_image");
+	auto dimension = imageDimension(source);
+
+	DeviceReduction reduction(context, program, source, type, channel);
+	std::vector<cl::Event> reduced = { reduction.enqueue(queue, waitEvents) };
+
+	auto output = createRgbBuffer(context, dimension);
+	cl::Kernel render(program, "render_normalized");
+	render.setArg(0, source);
+	render.setArg(1, (std::int32_t)type);
+	render.setArg(2, channel);
+	render.setArg(3, reduction.getStats());
+	render.setArg(4, output);
+
+	std::vector<cl::Event> rendered(1);
+	queue.enqueueNDRangeKernel(render, cl::NullRange, dimension, cl::NullRange, &reduced, &rendered[0]);
+	saveRgbBuffer(queue, output, dimension[0], dimension[1], targetFile, rendered);
+}
+
+// Flow direction as hue and magnitude as saturation, normalized to the largest magnitude
+void saveFlowColor(cl::Context const& context, cl::Program const& program, cl::CommandQueue const& queue,
+	cl::Image2D const& flow, std::string const& targetFile, std::vector<cl::Event> const& waitEvents)
+{
+	TimedEvent event("save_image");
+	auto dimension = imageDimension(flow);
+
+	DeviceReduction reduction(context, program, flow, PixelType::Float, MAGNITUDE_CHANNEL);
+	std::vector<cl::Event> reduced = { reduction.enqueue(queue, waitEvents) };
+
+	auto output = createRgbBuffer(context, dimension);
+	cl::Kernel render(program, "render_flow_color");
+	render.setArg(0, flow);
+	render.setArg(1, reduction.getStats());
+	render.setArg(2, output);
+
+	std::vector<cl::Event> rendered(1);
+	queue.enqueueNDRangeKernel(render, cl::NullRange, dimension, cl::NullRange, &reduced, &rendered[0]);
+	saveRgbBuffer(queue, output, dimension[0], dimension[1], targetFile, rendered);
+}
+
+// Distance between the arrows of the overlay
+const std::int32_t ARROW_STEP = 8;
+
+// Arrows of the flow drawn over the base image, the flow has the resolution of the base image
+void saveArrows(cl::Context const& context, cl::Program const& program, cl::CommandQueue const& queue,
+	cl::Image2D const& base, cl::Image2D const& flow, std::string const& targetFile, std::vector<cl::Event> const& waitEvents)
+{
+	TimedEvent event("save_image");
+	auto dimension = imageDimension(base);
+	auto output = createRgbBuffer(context, dimension);
+
+	cl::Kernel renderBase(program, "render_base");
+	renderBase.setArg(0, base);
+	renderBase.setArg(1, output);
+
+	std::vector<cl::Event> background(1);
+	queue.enqueueNDRangeKernel(renderBase, cl::NullRange, dimension, cl::NullRange, &waitEvents, &background[0]);
+
+	cl::Kernel renderArrows(program, "render_arrows");
+	renderArrows.setArg(0, flow);
+	renderArrows.setArg(1, ARROW_STEP);
+	renderArrows.setArg(2, output);
+
+	std::vector<cl::Event> rendered(1);
+	cl::NDRange arrows((dimension[0] + ARROW_STEP - 1) / ARROW_STEP, (dimension[1] + ARROW_STEP - 1) / ARROW_STEP);
+	queue.enqueueNDRangeKernel(renderArrows, cl::NullRange, arrows, cl::NullRange, &background, &rendered[0]);
+	saveRgbBuffer(queue, output, dimension[0], dimension[1], targetFile, rendered);
+}
+
+// Build options for the kernel specializations: tile size and number of channels
+std::string programOptions(TuningTable const& tuning)
+{
+	return tuning.getProgramOptions() + " -D CHANNELS=" + std::to_string(CHANNELS);
+}
+
+// Key of the stored tuning besides device and frame size, the best tile size depends on the
+// local memory of the flow kernel, which changes with the channels and the sampling. The table
+// is tuned for the default configuration (FLOW_SAMPLING) only: the benchmarks of the other
+// samplings reuse its tile size, which is valid but not necessarily the fastest for them.
+std::string tuningConfiguration()
+{
+	return "channels-" + std::to_string(CHANNELS) + "-" + flowKernelName(FLOW_SAMPLING);
+}
+
+// Kernels launched with the tuned local size, the local memory kernels use the tile size
+const std::vector<std::string> IMAGE_KERNELS = { "downfilter_x", "downfilter_y", "filter_G",
+	"scharr_x_horizontal", "scharr_x_vertical", "scharr_y_horizontal", "scharr_y_vertical", "flow_bilateral", "flow_upsample",
+	"flow_downsample", "dis_patch_search", "dis_densify" };
+
+// Kernels with local memory tiles, launched with the tile size as local size
+const std::vector<std::string> TILE_KERNELS = { "optical_flow_2", "optical_flow_buffer", "optical_flow_fixed", "flow_median" };
+
+const std::size_t TUNING_RUNS = 3;
+
+// Returns false if one of the TILE_KERNELS of a program built with the tile size exceeds the
+// work-group size or the local memory the device allows for it
+bool fitsTileSize(cl::Device const& device, cl::Program const& program, cl::NDRange const& tileSize)
+{
+	auto localMemorySize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	for (auto& name : TILE_KERNELS)
+	{
+		cl::Kernel kernel(program, name.c_str());
+		if (tileSize[0] * tileSize[1] > kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)
+			|| kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device) > localMemorySize)
+			return false;
+	}
+	return true;
+}
+
+// Adds the fastest of TUNING_RUNS replays per kernel of one session, the first replay is a warm up
+void measureSession(cl::Context const& context, cl::CommandQueue const& queue, cl::Program const& program, TuningTable const& tuning,
+	InputImage const& firstImage, InputImage const& secondImage, TemporalOptions const& temporal, FlowEngine engine, KernelTimes& times)
+{
+	FlowSession session(context, program, tuning, firstImage.width(), firstImage.height(), DEFAULT_FLOW_FILTER, temporal, engine);
+	session.process(queue, firstImage, secondImage);
+	queue.finish();
+
+	KernelTimes bestTimes;
+	for (std::size_t run = 0; run < TUNING_RUNS; ++run)
+	{
+		session.process(queue, firstImage, secondImage);
+		queue.finish();
+
+		KernelTimes runTimes;
+		session.getGraph().addKernelTimes(runTimes);
+		for (auto& entry : runTimes)
+		{
+			auto found = bestTimes.find(entry.first);
+			if (found == bestTimes.end() || entry.second < found->second)
+				bestTimes[entry.first] = entry.second;
+		}
+	}
+
+	for (auto& entry : bestTimes)
+		times[entry.first] += entry.second;
+}
+
+// Measures the default session, a session with temporal prediction (flow_downsample) and one
+// with the patch inverse search (dis_*), the times of a kernel are summed over the sessions
+// it runs in. Returns false if the configuration can not be launched on the device. The queue
+// has to be created with CL_QUEUE_PROFILING_ENABLE.
+bool measureConfiguration(cl::Context const& context, cl::CommandQueue const& queue, cl::Program const& program, TuningTable const& tuning,
+	InputImage const& firstImage, InputImage const& secondImage, KernelTimes& times)
+{
+	try
+	{
+		measureSession(context, queue, program, tuning, firstImage, secondImage, NO_TEMPORAL_PREDICTION, FLOW_ENGINE, times);
+		measureSession(context, queue, program, tuning, firstImage, secondImage, DEFAULT_TEMPORAL_PREDICTION, FlowEngine::LucasKanade, times);
+		measureSession(context, queue, program, tuning, firstImage, secondImage, NO_TEMPORAL_PREDICTION, FlowEngine::PatchInverseSearch, times);
+		return true;
+	}
+	catch (cl::Error const& error)
+	{
+		std::cout << "[Tuning]: configuration failed (" << error.err() << "): " << error.what() << "\n";
+		queue.finish();
+		return false;
+	}
+}
+
+// Benchmarks candidate local sizes for every kernel on the device at the real frame size.
+// The image kernels are measured for all candidates in one session each, the tile size
+// of the local memory kernels needs its own program build per candidate.
+TuningTable autotune(cl::Context const& context, cl::Device const& device, cl::CommandQueue const& queue,
+	InputImage const& firstImage, InputImage const& secondImage)
+{
+	TimedEvent timer("autotune");
+	TuningTable tuning(firstImage.width(), firstImage.height(), tuningConfiguration());
+
+	auto maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+
+	// Tile sizes, both dimensions have to be at least 2*FRAD
+	const std::vector<cl::NDRange> tileCandidates = { cl::NDRange(8, 8), cl::NDRange(16, 8), cl::NDRange(8, 16),
+		cl::NDRange(16, 16), cl::NDRange(32, 8) };
+	cl_ulong bestTileTime = 0;
+	for (auto& candidate : tileCandidates)
+	{
+		if (candidate[0] * candidate[1] > maxWorkGroupSize)
+			continue;
+
+		TuningTable trial = tuning;
+		trial.setTileSize(candidate);
+		auto program = buildProgram(context, device, PROGRAM_FILE, programOptions(trial));
+		if (!fitsTileSize(device, program, candidate))
+		{
+			std::cout << "[Tuning]: tile " << candidate[0] << "x" << candidate[1] << " exceeds the kernel limits\n";
+			continue;
+		}
+
+		KernelTimes times;
+		if (!measureConfiguration(context, queue, program, trial, firstImage, secondImage, times))
+			continue;
+
+		auto tileTime = times[flowKernelName(FLOW_SAMPLING)] + times["flow_median"];
+		std::cout << "[Tuning]: tile " << candidate[0] << "x" << candidate[1] << ": " << tileTime / 1000 << " us\n";
+		if (bestTileTime == 0 || tileTime < bestTileTime)
+		{
+			bestTileTime = tileTime;
+			tuning.setTileSize(candidate);
+		}
+	}
+
+	// Local sizes of the image kernels, cl::NullRange leaves the choice to the driver
+	const std::vector<cl::NDRange> localCandidates = { cl::NullRange, cl::NDRange(8, 8), cl::NDRange(16, 8),
+		cl::NDRange(16, 16), cl::NDRange(32, 4), cl::NDRange(32, 8), cl::NDRange(64, 4), cl::NDRange(128, 1), cl::NDRange(256, 1) };
+
+	auto program = buildProgram(context, device, PROGRAM_FILE, programOptions(tuning));
+
+	std::size_t kernelWorkGroupSize = maxWorkGroupSize;
+	for (auto& name : IMAGE_KERNELS)
+	{
+		cl::Kernel kernel(program, name.c_str());
+		kernelWorkGroupSize = std::min(kernelWorkGroupSize, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	}
+
+	KernelTimes bestTimes;
+	for (auto& candidate : localCandidates)
+	{
+		if (candidate.dimensions() != 0 && candidate[0] * candidate[1] > kernelWorkGroupSize)
+			continue;
+
+		TuningTable trial = tuning;
+		for (auto& name : IMAGE_KERNELS)
+			trial.setLocalSize(name, candidate);
+
+		KernelTimes times;
+		if (!measureConfiguration(context, queue, program, trial, firstImage, secondImage, times))
+			continue;
+
+		for (auto& name : IMAGE_KERNELS)
+		{
+			auto measured = times.find(name);
+			if (measured == times.end())
+				continue;
+
+			auto found = bestTimes.find(name);
+			if (found == bestTimes.end() || measured->second < found->second)
+			{
+				bestTimes[name] = measured->second;
+				tuning.setLocalSize(name, candidate);
+			}
+		}
+	}
+
+	for (auto& name : IMAGE_KERNELS)
+	{
+		auto localSize = tuning.getLocalSize(name);
+		std::cout << "[Tuning]: " << name << ": ";
+		if (localSize.dimensions() == 0)
+			std::cout << "driver";
+		else
+			std::cout << localSize[0] << "x" << localSize[1];
+		std::cout << " (" << bestTimes[name] / 1000 << " us)\n";
+	}
+
+	return tuning;
+}
+
+// Copy of the image moved by (dx, dy) pixels, the uncovered border repeats the edge pixels
+InputImage shiftImage(InputImage const& source, int dx, int dy)
+{
+	InputImage shifted(source.dimensions());
+	auto sourceView = const_view(source);
+	auto targetView = view(shifted);
+
+	int width = (int)source.width();
+	int height = (int)source.height();
+	for (int y = 0; y < height; ++y)
+	{
+		int sourceY = std::min(std::max(y - dy, 0), height - 1);
+		for (int x = 0; x < width; ++x)
+		{
+			int sourceX = std::min(std::max(x - dx, 0), width - 1);
+			targetView(x, y) = sourceView(sourceX, sourceY);
+		}
+	}
+	return shifted;
+}
+
+// Concurrent streams: every stream has its own FlowSession and processes its own frame pair
+const std::size_t STREAM_COUNT = 8;
+const std::size_t STREAM_FRAMES = 25;
+const std::size_t STREAM_QUEUE_CAPACITY = 2;
+
+// If false every worker creates its own context and builds its own program, otherwise the
+// workers share the context of main and only have their own command queue
+const bool SHARE_CONTEXT = true;
+
+struct StreamWorker
+{
+	cl::Context context;
+	cl::Program program;
+	cl::CommandQueue queue;
+};
+
+struct StreamState
+{
+	std::unique_ptr<FlowSession> session;
+	std::vector<float> flow;
+};
+
+typedef std::pair<InputImage, InputImage> FramePair;
+
+// Runs STREAM_COUNT streams of STREAM_FRAMES frames each on workerCount threads, stream i
+// processes pairs[i]. Every frame is read back to the host, so the latency covers the complete
+// pipeline.
+SchedulerStats runStreams(cl::Context const& context, cl::Device const& device, cl::Program const& program, TuningTable const& tuning,
+	std::vector<FramePair> const& pairs, std::size_t workerCount)
+{
+	auto width = pairs[0].first.width();
+	auto height = pairs[0].first.height();
+
+	std::vector<StreamWorker> workers(workerCount);
+	for (auto& worker : workers)
+	{
+		worker.context = SHARE_CONTEXT ? context : cl::Context(device);
+		worker.program = SHARE_CONTEXT ? program : buildProgram(worker.context, device, PROGRAM_FILE, programOptions(tuning));
+		worker.queue = cl::CommandQueue(worker.context, device);
+	}
+
+	std::vector<StreamState> streams(STREAM_COUNT);
+	auto processFrame = [&](std::size_t stream, std::size_t workerIndex)
+	{
+		auto& state = streams[stream];
+		auto& worker = workers[workerIndex];
+
+		// Sessions are created on the worker thread, a stream always stays on the same worker
+		if (!state.session)
+		{
+			state.session.reset(new FlowSession(worker.context, worker.program, tuning, width, height, DEFAULT_FLOW_FILTER));
+			state.flow.resize(width * height * 2);
+		}
+
+		state.session->process(worker.queue, pairs[stream].first, pairs[stream].second);
+
+		cl::size_t<3> origin;
+		cl::size_t<3> region;
+		region[0] = width;
+		region[1] = height;
+		region[2] = 1;
+		std::vector<cl::Event> waitEvents = { state.session->getFinished() };
+		worker.queue.enqueueReadImage(state.session->getFlow(), CL_TRUE, origin, region, 0, 0, state.flow.data(), &waitEvents);
+	};
+
+	StreamScheduler scheduler(workerCount, STREAM_QUEUE_CAPACITY);
+	for (std::size_t stream = 0; stream < STREAM_COUNT; ++stream)
+		scheduler.addStream();
+
+	// Warm up frame per stream, creates the sessions
+	for (std::size_t stream = 0; stream < STREAM_COUNT; ++stream)
+		scheduler.submit(stream, [&, stream](std::size_t worker) { processFrame(stream, worker); });
+	scheduler.wait();
+	scheduler.resetStats();
+
+	for (std::size_t frame = 0; frame < STREAM_FRAMES; ++frame)
+	{
+		for (std::size_t stream = 0; stream < STREAM_COUNT; ++stream)
+			scheduler.submit(stream, [&, stream](std::size_t worker) { processFrame(stream, worker); });
+	}
+	scheduler.wait();
+
+	return scheduler.getStats();
+}
+
+// Throughput for a growing number of workers, it should scale until the device is saturated.
+// The pair of stream i is shifted by i pixels, so the streams do not read the same input data.
+void benchmarkStreams(cl::Context const& context, cl::Device const& device, cl::Program const& program, TuningTable const& tuning,
+	InputImage const& firstImage, InputImage const& secondImage)
+{
+	std::vector<FramePair> pairs;
+	for (std::size_t stream = 0; stream < STREAM_COUNT; ++stream)
+		pairs.push_back(FramePair(shiftImage(firstImage, (int)stream, 0), shiftImage(secondImage, (int)stream, 0)));
+
+	std::size_t maxWorkers = std::min<std::size_t>(STREAM_COUNT, std::max(1u, std::thread::hardware_concurrency()));
+	double singleWorkerRate = 0.0;
+	for (std::size_t workerCount = 1; workerCount <= maxWorkers; workerCount *= 2)
+	{
+		auto stats = runStreams(context, device, program, tuning, pairs, workerCount);
+		if (workerCount == 1)
+			singleWorkerRate = stats.framesPerSecond;
+
+		std::cout << "[Streams]: " << workerCount << " workers, " << STREAM_COUNT << " streams";
+		if (singleWorkerRate > 0.0)
+			std::cout << ", speedup " << stats.framesPerSecond / singleWorkerRate;
+		std::cout << "\n";
+		writeSchedulerStats(std::cout, stats);
+	}
+}
+
+// Synthetic sequence with known motion: frame k is the first image shifted by k times the motion
+const std::size_t SEQUENCE_FRAMES = 12;
+const int SEQUENCE_MOTION_X = 2;
+const int SEQUENCE_MOTION_Y = 1;
+
+// Pixels at the border are not compared because the shift clamps them
+const std::size_t SEQUENCE_BORDER = 16;
+
+// Raw level 0 flow without post processing for the comparison
+const FlowFilterOptions SEQUENCE_FILTER = { 0, false, 2.0f, 12.0f, 0 };
+
+// Raw level 0 flow of the last processed pair, two floats per pixel
+std::vector<float> readFlow(cl::CommandQueue const& queue, FlowSession const& session)
+{
+	auto& dimension = session.getFirstPyramid().getDimension(0);
+
+	std::vector<float> flow(dimension[0] * dimension[1] * 2);
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	region[0] = dimension[0];
+	region[1] = dimension[1];
+	region[2] = 1;
+	std::vector<cl::Event> waitEvents = { session.getFlowPyramid().getFinished(0) };
+	queue.enqueueReadImage(session.getFlowPyramid().getVector(0), CL_TRUE, origin, region, 0, 0, flow.data(), &waitEvents);
+	return flow;
+}
+
+// Mean endpoint error of the level 0 flow against the known motion
+double endpointError(cl::CommandQueue const& queue, FlowSession const& session, float motionX, float motionY)
+{
+	auto& dimension = session.getFirstPyramid().getDimension(0);
+	std::size_t width = dimension[0];
+	std::size_t height = dimension[1];
+	auto flow = readFlow(queue, session);
+
+	double error = 0.0;
+	std::size_t count = 0;
+	for (std::size_t y = SEQUENCE_BORDER; y + SEQUENCE_BORDER < height; ++y)
+	{
+		for (std::size_t x = SEQUENCE_BORDER; x + SEQUENCE_BORDER < width; ++x)
+		{
+			float dx = flow[(y * width + x) * 2] - motionX;
+			float dy = flow[(y * width + x) * 2 + 1] - motionY;
+			error += std::sqrt(dx * dx + dy * dy);
+			++count;
+		}
+	}
+	return (count > 0) ? error / count : 0.0;
+}
+
+// Runs the synthetic sequence without and with temporal prediction and compares the flow
+// iterations, the flow kernel time and the endpoint error
+void benchmarkTemporal(cl::Context const& context, cl::CommandQueue const& queue, cl::Program const& program, TuningTable const& tuning,
+	InputImage const& firstImage)
+{
+	std::vector<InputImage> frames;
+	for (std::size_t k = 0; k < SEQUENCE_FRAMES; ++k)
+		frames.push_back(shiftImage(firstImage, (int)k * SEQUENCE_MOTION_X, (int)k * SEQUENCE_MOTION_Y));
+
+	TemporalOptions coarse = DEFAULT_TEMPORAL_PREDICTION;
+	coarse.prediction = TemporalPrediction::Coarse;
+	TemporalOptions fewerLevels = DEFAULT_TEMPORAL_PREDICTION;
+	fewerLevels.predictedTopLevel = PYRAMID_HEIGHT - 2;
+
+	std::vector<std::pair<std::string, TemporalOptions>> configurations = {
+		std::make_pair("none", NO_TEMPORAL_PREDICTION),
+		std::make_pair("downsampled", DEFAULT_TEMPORAL_PREDICTION),
+		std::make_pair("coarse", coarse),
+		std::make_pair("downsampled, top level " + std::to_string(fewerLevels.predictedTopLevel), fewerLevels)
+	};
+
+	std::uint64_t baselineIterations = 0;
+	for (auto& configuration : configurations)
+	{
+		FlowSession session(context, program, tuning, firstImage.width(), firstImage.height(), SEQUENCE_FILTER, configuration.second);
+		session.countIterations(true);
+
+		cl_ulong flowTime = 0;
+		double error = 0.0;
+		for (std::size_t k = 0; k + 1 < frames.size(); ++k)
+		{
+			session.process(queue, frames[k], frames[k + 1]);
+			queue.finish();
+
+			KernelTimes times;
+			session.getGraph().addKernelTimes(times);
+			flowTime += times[flowKernelName(FLOW_SAMPLING)] + times["flow_downsample"];
+			error += endpointError(queue, session, (float)SEQUENCE_MOTION_X, (float)SEQUENCE_MOTION_Y);
+		}
+
+		auto& stats = session.getIterationStats();
+		std::uint64_t iterations = 0;
+		for (auto levelIterations : stats.iterations)
+			iterations += levelIterations;
+		if (baselineIterations == 0)
+			baselineIterations = iterations;
+
+		std::cout << "[Temporal]: " << configuration.first << ": flow " << flowTime / 1000 / stats.frames << " us/pair, endpoint error "
+			<< error / stats.frames << " px, iterations " << 100.0 * iterations / baselineIterations << "% of no prediction\n";
+		session.writeIterationStats(std::cout);
+	}
+}
+
+// Shifts of the second image for the engine comparison, from small to large motion
+const std::vector<std::pair<int, int>> ENGINE_MOTIONS = { { 1, 0 }, { 3, 2 }, { 6, -4 } };
+
+// Compares the flow kernel time and the endpoint error of the Lucas-Kanade and the DIS engine
+// on image pairs with known motion
+void benchmarkEngines(cl::Context const& context, cl::CommandQueue const& queue, cl::Program const& program, TuningTable const& tuning,
+	InputImage const& firstImage)
+{
+	std::vector<std::pair<std::string, FlowEngine>> engines = {
+		std::make_pair("lucas-kanade", FlowEngine::LucasKanade),
+		std::make_pair("patch inverse search", FlowEngine::PatchInverseSearch)
+	};
+
+	std::vector<cl_ulong> baselineTimes;
+	for (auto& engine : engines)
+	{
+		FlowSession session(context, program, tuning, firstImage.width(), firstImage.height(), SEQUENCE_FILTER, NO_TEMPORAL_PREDICTION, engine.second);
+
+		// Warm up, the first replay includes the lazy allocation of the driver
+		session.process(queue, firstImage, firstImage);
+		queue.finish();
+
+		for (std::size_t i = 0; i < ENGINE_MOTIONS.size(); ++i)
+		{
+			auto& motion = ENGINE_MOTIONS[i];
+			auto secondImage = shiftImage(firstImage, motion.first, motion.second);
+			session.process(queue, firstImage, secondImage);
+			queue.finish();
+
+			KernelTimes times;
+			session.getGraph().addKernelTimes(times);
+			cl_ulong flowTime = (engine.second == FlowEngine::LucasKanade)
+				? times["filter_G"] + times[flowKernelName(FLOW_SAMPLING)]
+				: times["dis_patch_search"] + times["dis_densify"];
+			cl_ulong totalTime = 0;
+			for (auto& entry : times)
+				totalTime += entry.second;
+			auto error = endpointError(queue, session, (float)motion.first, (float)motion.second);
+
+			std::cout << "[Engines]: " << engine.first << ", motion (" << motion.first << ", " << motion.second << "): flow "
+				<< flowTime / 1000 << " us, all kernels " << totalTime / 1000 << " us, endpoint error " << error << " px";
+			if (baselineTimes.size() == ENGINE_MOTIONS.size() && flowTime > 0)
+				std::cout << ", flow speedup " << (double)baselineTimes[i] / flowTime;
+			std::cout << "\n";
+
+			if (baselineTimes.size() < ENGINE_MOTIONS.size())
+				baselineTimes.push_back(flowTime);
+		}
+	}
+}
+
+// Compares the integer flow kernel with the float buffer kernel on the shifted pairs of the
+// engine comparison: kernel time, endpoint error against the known motion and the endpoint
+// difference between both flows, which is the measured counterpart of the error bounds
+// documented at optical_flow_fixed. Both kernels run with the tile size tuned for FLOW_SAMPLING.
+void benchmarkFixedPoint(cl::Context const& context, cl::CommandQueue const& queue, cl::Program const& program, TuningTable const& tuning,
+	InputImage const& firstImage)
+{
+	FlowSession floatSession(context, program, tuning, firstImage.width(), firstImage.height(), SEQUENCE_FILTER,
+		NO_TEMPORAL_PREDICTION, FlowEngine::LucasKanade, FlowSampling::Buffer);
+	FlowSession fixedSession(context, program, tuning, firstImage.width(), firstImage.height(), SEQUENCE_FILTER,
+		NO_TEMPORAL_PREDICTION, FlowEngine::LucasKanade, FlowSampling::FixedPoint);
+
+	// Warm up, the first replay includes the lazy allocation of the driver
+	floatSession.process(queue, firstImage, firstImage);
+	fixedSession.process(queue, firstImage, firstImage);
+	queue.finish();
+
+	for (auto& motion : ENGINE_MOTIONS)
+	{
+		auto secondImage = shiftImage(firstImage, motion.first, motion.second);
+
+		cl_ulong floatTime = 0;
+		cl_ulong fixedTime = 0;
+		for (std::size_t run = 0; run < TUNING_RUNS; ++run)
+		{
+			floatSession.process(queue, firstImage, secondImage);
+			fixedSession.process(queue, firstImage, secondImage);
+			queue.finish();
+
+			KernelTimes times;
+			floatSession.getGraph().addKernelTimes(times);
+			fixedSession.getGraph().addKernelTimes(times);
+			floatTime += times[flowKernelName(FlowSampling::Buffer)];
+			fixedTime += times[flowKernelName(FlowSampling::FixedPoint)];
+		}
+
+		auto floatFlow = readFlow(queue, floatSession);
+		auto fixedFlow = readFlow(queue, fixedSession);
+		auto& dimension = floatSession.getFirstPyramid().getDimension(0);
+		double meanDifference = 0.0;
+		double maxDifference = 0.0;
+		std::size_t count = 0;
+		for (std::size_t y = SEQUENCE_BORDER; y + SEQUENCE_BORDER < dimension[1]; ++y)
+		{
+			for (std::size_t x = SEQUENCE_BORDER; x + SEQUENCE_BORDER < dimension[0]; ++x)
+			{
+				auto index = (y * dimension[0] + x) * 2;
+				float dx = fixedFlow[index] - floatFlow[index];
+				float dy = fixedFlow[index + 1] - floatFlow[index + 1];
+				double difference = std::sqrt(dx * dx + dy * dy);
+				meanDifference += difference;
+				maxDifference = std::max(maxDifference, difference);
+				++count;
+			}
+		}
+		if (count > 0)
+			meanDifference /= count;
+
+		std::cout << "[FixedPoint]: motion (" << motion.first << ", " << motion.second << "): float "
+			<< floatTime / 1000 / TUNING_RUNS << " us, fixed " << fixedTime / 1000 / TUNING_RUNS << " us";
+		if (fixedTime > 0)
+			std::cout << ", speedup " << (double)floatTime / fixedTime;
+		std::cout << ", endpoint error float " << endpointError(queue, floatSession, (float)motion.first, (float)motion.second)
+			<< " px, fixed " << endpointError(queue, fixedSession, (float)motion.first, (float)motion.second)
+			<< " px, difference mean " << meanDifference << " px, max " << maxDifference << " px\n";
+	}
+}
+
+// Frames replayed after the debug output to measure the host cost per frame
+const std::size_t BENCHMARK_FRAMES = 50;
+
+int main()
+{
+	try
+	{
+		InputImage firstImage, secondImage;
+		loadImage(FIRST_IMAGE, firstImage);
+		loadImage(SECOND_IMAGE, secondImage);
+		if (firstImage.dimensions() != secondImage.dimensions())
+		{
+			std::cout << "The images have different dimensions!\n";
+			return -1;
+		}
+
+		auto platform = choosePlatform();
+		auto device = chooseDevice(platform, CL_DEVICE_TYPE_ALL);
+
+		cl::Context context(device);
+		cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+		// Tune once per device, frame size and configuration, later runs use the stored local sizes
+		auto tuningFile = tuningFileName(device);
+		TuningTable tuning(firstImage.width(), firstImage.height(), tuningConfiguration());
+		if (!tuning.load(tuningFile))
+		{
+			tuning = autotune(context, device, queue, firstImage, secondImage);
+			tuning.save(tuningFile);
+		}
+
+		auto program = buildProgram(context, device, PROGRAM_FILE, programOptions(tuning));
+		FlowSession session(context, program, tuning, firstImage.width(), firstImage.height(), DEFAULT_FLOW_FILTER);
+
+		Timer timer;
+		timer.start();
+
+		session.process(queue, firstImage, secondImage);
+
+		auto& firstImagePyramid = session.getFirstPyramid();
+		auto& secondImagePyramid = session.getSecondPyramid();
+		auto& derivativeX = session.getDerivativeX();
+		auto& derivativeY = session.getDerivativeY();
+		auto* matrixG = session.getMatrixG();
+		auto& flow = session.getFlowPyramid();
+
+		for (int i = 0; i < 3; ++i)
+		{
+			auto& image = firstImagePyramid.getImage(i);
+			saveImage(queue, image, "output/first-scaled-" + std::to_string(i) + ".jpg", { firstImagePyramid.getFinished(i) });
+		}
+
+		for (int i = 0; i < 3; ++i)
+		{
+			auto& image = secondImagePyramid.getImage(i);
+			saveImage(queue, image, "output/second-scaled-" + std::to_string(i) + ".jpg", { secondImagePyramid.getFinished(i) });
+		}
+
+		for (int i = 0; i < 3; ++i)
+		{
+			auto& image = derivativeX.getDerivative(i);
+			saveNormalized(context, program, queue, image, PixelType::Signed, 0, "output/scharr-x-" + std::to_string(i) + ".jpg", { derivativeX.getFinished(i) });
+		}
+
+		for (int i = 0; i < 3; ++i)
+		{
+			auto& image = derivativeY.getDerivative(i);
+			saveNormalized(context, program, queue, image, PixelType::Signed, 0, "output/scharr-y-" + std::to_string(i) + ".jpg", { derivativeY.getFinished(i) });
+		}
+
+		for (int i = 0; matrixG && i < 3; ++i)
+		{
+			auto& image = matrixG->getMatrix(i);
+			for (int index = 0; index < 4; ++index)
+			{
+				saveNormalized(context, program, queue, image, PixelType::Signed, index,
+					"output/g-matrix-" + std::to_string(index) + "-" + std::to_string(i) + ".jpg", { matrixG->getFinished(i) });
+			}
+		}
+
+		for (int i = 0; i < 3; ++i)
+		{
+			auto& image = flow.getVector(i);
+			saveNormalized(context, program, queue, image, PixelType::Float, 0, "output/flow-x-" + std::to_string(i) + ".jpg", { flow.getFinished(i) });
+			saveNormalized(context, program, queue, image, PixelType::Float, 1, "output/flow-y-" + std::to_string(i) + ".jpg", { flow.getFinished(i) });
+		}
+
+		saveFlowColor(context, program, queue, session.getFlow(), "output/flow-color.jpg", { session.getFinished() });
+
+		saveArrows(context, program, queue, firstImagePyramid.getImage(0), session.getFlow(), "output/lines.jpeg", { session.getFinished() });
+		saveArrows(context, program, queue, secondImagePyramid.getImage(0), session.getFlow(), "output/lines2.jpeg", { session.getFinished() });
+
+		// Per frame motion stats computed in the session, only the 16 bytes of the stats and the histogram are read
+		auto motion = session.readMotionStats(queue);
+		auto motionHistogram = session.readMotionHistogram(queue);
+		std::cout << "[Motion]: mean " << motion.mean() << " px, max " << motion.maximum << " px, 95% below "
+			<< histogramPercentile(motionHistogram, motion, 0.95f) << " px\n";
+
+
+		queue.finish();
+		timer.stop("down_filter_all");
+
+		std::ofstream out("profile.csv");
+
+		auto baseCounter = firstImagePyramid.getFinished(0).getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+
+		out << ";Not Existing;Queued;Submitted;Running\n";
+
+		session.writeProfile(out, baseCounter);
+
+		// Steady state: the same session is replayed without any further kernel setup
+		{
+			TimedEvent benchmark("replay " + std::to_string(BENCHMARK_FRAMES) + " frames");
+			for (std::size_t frame = 0; frame < BENCHMARK_FRAMES; ++frame)
+				session.process(queue, firstImage, secondImage);
+			queue.finish();
+		}
+		session.writeHostTimes(std::cout);
+
+		benchmarkStreams(context, device, program, tuning, firstImage, secondImage);
+
+		benchmarkTemporal(context, queue, program, tuning, firstImage);
+
+		benchmarkEngines(context, queue, program, tuning, firstImage);
 
-		firstImagePyramid.writeProfile(out, "image 1", baseCounter);
-		secondImagePyramid.writeProfile(out, "image 2", baseCounter);
-		derivativeX.writeProfile(out, "X", baseCounter);
-		derivativeY.writeProfile(out, "Y", baseCounter);
-		matrixG.writeProfile(out, "matrix", baseCounter);
-		flow.writeProfile(out, "optical", baseCounter);
+		benchmarkFixedPoint(context, queue, program, tuning, firstImage);
 
 		return 0;
 	}
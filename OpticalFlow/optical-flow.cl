@@ -2,23 +2,73 @@ const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
 							CLK_ADDRESS_CLAMP_TO_EDGE |
 							CLK_FILTER_NEAREST;
 
+// Number of channels of the input images, 1 for gray (CL_R) or 4 for color (CL_RGBA). The
+// image, Scharr and flow kernels process all channels of a pixel together, so color costs
+// the same number of image reads as gray. Set by the host with -D CHANNELS.
+// Alpha is constant, so sums over the channels of a pixel only use the COLOR_CHANNELS color
+// channels and averages divide by COLOR_CHANNELS: a color image with equal channels gives the
+// same G, determinant and mismatch as its gray version and the thresholds apply to both.
+#ifndef CHANNELS
+#define CHANNELS 1
+#endif
+
+#if CHANNELS == 4
+typedef float4 channelf;
+typedef int4 channeli;
+typedef short4 channels;
+#define PIXEL_F(p) convert_float4(p)
+#define PIXEL_I(p) (p)
+#define PIXEL_UI(p) convert_int4(p)
+#define CHANNEL_I(v) convert_int4(v)
+#define CHANNEL_F(v) convert_float4(v)
+#define CHANNEL_S(v) convert_short4(v)
+#define UINT_PIXEL(v) convert_uint4(v)
+#define INT_PIXEL(v) (v)
+#define COLOR_CHANNELS 3
+#define SUM_COLOR(v) ((v).x + (v).y + (v).z)
+// Integer average of the color channels of an int4 without overflowing the sum, the remainders
+// are added separately (exact if all channels have the same sign)
+#define AVERAGE_COLOR(v) ((v).x / 3 + (v).y / 3 + (v).z / 3 + ((v).x % 3 + (v).y % 3 + (v).z % 3) / 3)
+#elif CHANNELS == 1
+typedef float channelf;
+typedef int channeli;
+typedef short channels;
+#define PIXEL_F(p) ((float)(p).x)
+#define PIXEL_I(p) ((p).x)
+#define PIXEL_UI(p) ((int)(p).x)
+#define CHANNEL_I(v) ((int)(v))
+#define CHANNEL_F(v) ((float)(v))
+#define CHANNEL_S(v) ((short)(v))
+#define UINT_PIXEL(v) ((uint4)((v), 0, 0, 0))
+#define INT_PIXEL(v) ((int4)((v), 0, 0, 0))
+#define COLOR_CHANNELS 1
+#define SUM_COLOR(v) (v)
+#define AVERAGE_COLOR(v) (v)
+#else
+#error "CHANNELS has to be 1 or 4"
+#endif
+
 __kernel
 void downfilter_x(__read_only image2d_t source,
                   __write_only image2d_t destination)
 {
 	const int ix = get_global_id(0);
 	const int iy = get_global_id(1);
+
+	if (ix >= get_image_width(destination) || iy >= get_image_height(destination))
+		return;
+
 	const int2 pos = { ix, iy };
 
-	float x0 = read_imageui(source, sampler, (int2)(ix-2,iy)).x * 0.0625f;
-	float x1 = read_imageui(source, sampler, (int2)(ix-1,iy)).x * 0.25f;
-	float x2 = read_imageui(source, sampler, pos).x * 0.375f;
-	float x3 = read_imageui(source, sampler, (int2)(ix+1,iy)).x * 0.25f;
-	float x4 = read_imageui(source, sampler, (int2)(ix+2,iy)).x * 0.0625f;
+	channelf x0 = PIXEL_F(read_imageui(source, sampler, (int2)(ix-2,iy))) * 0.0625f;
+	channelf x1 = PIXEL_F(read_imageui(source, sampler, (int2)(ix-1,iy))) * 0.25f;
+	channelf x2 = PIXEL_F(read_imageui(source, sampler, pos)) * 0.375f;
+	channelf x3 = PIXEL_F(read_imageui(source, sampler, (int2)(ix+1,iy))) * 0.25f;
+	channelf x4 = PIXEL_F(read_imageui(source, sampler, (int2)(ix+2,iy))) * 0.0625f;
 
-	int output = round(x0 + x1 + x2 + x3 + x4);
+	channeli output = CHANNEL_I(round(x0 + x1 + x2 + x3 + x4));
 
-	write_imageui(destination, pos, (uint4)(output, 0, 0, 0));
+	write_imageui(destination, pos, UINT_PIXEL(output));
 }
 
 __kernel
@@ -27,18 +77,22 @@ void downfilter_y(__read_only image2d_t source,
 {
 	const int ix = get_global_id(0);
 	const int iy = get_global_id(1);
+
+	if (ix >= get_image_width(destination) || iy >= get_image_height(destination))
+		return;
+
 	const int ix2 = 2 * ix;
 	const int iy2 = 2 * iy;
 
-	float x0 = read_imageui(source, sampler, (int2)(ix2, iy2-2)).x * 0.0625;
-	float x1 = read_imageui(source, sampler, (int2)(ix2, iy2-1)).x * 0.25f;
-	float x2 = read_imageui(source, sampler, (int2)(ix2, iy2+0)).x * 0.375f;
-	float x3 = read_imageui(source, sampler, (int2)(ix2, iy2+1)).x * 0.25f;
-	float x4 = read_imageui(source, sampler, (int2)(ix2, iy2+2)).x * 0.0625;
+	channelf x0 = PIXEL_F(read_imageui(source, sampler, (int2)(ix2, iy2-2))) * 0.0625f;
+	channelf x1 = PIXEL_F(read_imageui(source, sampler, (int2)(ix2, iy2-1))) * 0.25f;
+	channelf x2 = PIXEL_F(read_imageui(source, sampler, (int2)(ix2, iy2+0))) * 0.375f;
+	channelf x3 = PIXEL_F(read_imageui(source, sampler, (int2)(ix2, iy2+1))) * 0.25f;
+	channelf x4 = PIXEL_F(read_imageui(source, sampler, (int2)(ix2, iy2+2))) * 0.0625f;
 
-	int output = round(x0 + x1 + x2 + x3 + x4);
+	channeli output = CHANNEL_I(round(x0 + x1 + x2 + x3 + x4));
 
-	write_imageui(destination, (int2)(ix, iy), (uint4)(output, 0, 0, 0));
+	write_imageui(destination, (int2)(ix, iy), UINT_PIXEL(output));
 }
 
 #define WINDOW_RADIUS 4
@@ -51,16 +105,20 @@ void filter_G(__read_only image2d_t firstImage,
 	const int posX = get_global_id(0);
 	const int posY = get_global_id(1);
 
-	int Ix2 = 0;
-	int IxIy = 0;
-	int Iy2 = 0;
+	if (posX >= get_image_width(G) || posY >= get_image_height(G))
+		return;
+
+	// Summed per channel, a channel of the window fits into an int like the gray sum
+	channeli Ix2 = 0;
+	channeli IxIy = 0;
+	channeli Iy2 = 0;
 	for (int y = -WINDOW_RADIUS; y <= WINDOW_RADIUS; y++) 
 	{
 		for (int x = -WINDOW_RADIUS; x <= WINDOW_RADIUS ; x++) 
 		{
 			int2 samplePos = { posX + x, posY + y };
-			int ix = read_imagei(firstImage, sampler, samplePos).x;
-			int iy = read_imagei(secondImage, sampler, samplePos).x;
+			channeli ix = PIXEL_I(read_imagei(firstImage, sampler, samplePos));
+			channeli iy = PIXEL_I(read_imagei(secondImage, sampler, samplePos));
 
 			Ix2 += ix * ix;
 			Iy2 += iy * iy;
@@ -68,7 +126,8 @@ void filter_G(__read_only image2d_t firstImage,
 		}
 	}
 
-	int4 G2x2 = (int4)(Ix2, IxIy, IxIy, Iy2);
+	// Averaged over the color channels once for the whole window
+	int4 G2x2 = (int4)(AVERAGE_COLOR(Ix2), AVERAGE_COLOR(IxIy), AVERAGE_COLOR(IxIy), AVERAGE_COLOR(Iy2));
 	write_imagei(G, (int2)(posX, posY), G2x2);
 }
 
@@ -79,11 +138,14 @@ void scharr_x_horizontal(__read_only image2d_t source,
 	const int xPos = get_global_id(0);
     const int yPos = get_global_id(1);
 
-    int x0 = read_imagei(source, sampler, (int2)(xPos - 1, yPos)).x;
-    int x2 = read_imagei(source, sampler, (int2)(xPos + 1, yPos)).x;
-    int output = x2 - x0; 
+	if (xPos >= get_image_width(destination) || yPos >= get_image_height(destination))
+		return;
+
+    channeli x0 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos - 1, yPos)));
+    channeli x2 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos + 1, yPos)));
+    channeli output = x2 - x0; 
 
-	write_imagei(destination, (int2)(xPos, yPos), (int4)(output, 0, 0, 0)); 
+	write_imagei(destination, (int2)(xPos, yPos), INT_PIXEL(output)); 
 }
 
 __kernel 
@@ -93,12 +155,15 @@ void scharr_x_vertical(__read_only image2d_t source,
 	const int xPos = get_global_id(0);
     const int yPos = get_global_id(1);
 
-    int x0 = read_imagei(source, sampler, (int2)(xPos, yPos - 1)).x;
-    int x1 = read_imagei(source, sampler, (int2)(xPos, yPos)).x;
-    int x2 = read_imagei(source, sampler, (int2)(xPos, yPos + 1)).x;
+	if (xPos >= get_image_width(destination) || yPos >= get_image_height(destination))
+		return;
 
-    int output = 3 * x0 + 10 * x1 + 3 * x2;
-	write_imagei(destination, (int2)(xPos, yPos), (int4)(output, 0, 0, 0)); 
+    channeli x0 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos, yPos - 1)));
+    channeli x1 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos, yPos)));
+    channeli x2 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos, yPos + 1)));
+
+    channeli output = 3 * x0 + 10 * x1 + 3 * x2;
+	write_imagei(destination, (int2)(xPos, yPos), INT_PIXEL(output)); 
 }
 
 __kernel 
@@ -108,12 +173,15 @@ void scharr_y_horizontal(__read_only image2d_t source,
 	const int xPos = get_global_id(0);
     const int yPos = get_global_id(1);
 
-    int x0 = read_imagei(source, sampler, (int2)(xPos - 1, yPos)).x;
-    int x1 = read_imagei(source, sampler, (int2)(xPos, yPos)).x;
-    int x2 = read_imagei(source, sampler, (int2)(xPos + 1, yPos)).x;
+	if (xPos >= get_image_width(destination) || yPos >= get_image_height(destination))
+		return;
+
+    channeli x0 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos - 1, yPos)));
+    channeli x1 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos, yPos)));
+    channeli x2 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos + 1, yPos)));
 
-    int output = 3 * x0 + 10 * x1 + 3 * x2;
-	write_imagei(destination, (int2)(xPos, yPos), (int4)(output, 0, 0, 0)); 
+    channeli output = 3 * x0 + 10 * x1 + 3 * x2;
+	write_imagei(destination, (int2)(xPos, yPos), INT_PIXEL(output)); 
 }
 
 __kernel 
@@ -123,17 +191,30 @@ void scharr_y_vertical(__read_only image2d_t source,
 	const int xPos = get_global_id(0);
     const int yPos = get_global_id(1);
 
-    int x0 = read_imagei(source, sampler, (int2)(xPos, yPos - 1)).x;
-    int x2 = read_imagei(source, sampler, (int2)(xPos, yPos + 1)).x;
-    int output = x2 - x0; 
+	if (xPos >= get_image_width(destination) || yPos >= get_image_height(destination))
+		return;
+
+    channeli x0 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos, yPos - 1)));
+    channeli x2 = PIXEL_I(read_imagei(source, sampler, (int2)(xPos, yPos + 1)));
+    channeli output = x2 - x0; 
 
-	write_imagei(destination, (int2)(xPos, yPos), (int4)(output, 0, 0, 0)); 
+	write_imagei(destination, (int2)(xPos, yPos), INT_PIXEL(output)); 
 }
 
 #define FRAD 4
 #define eps 0.0000001f;
-#define LOCAL_X 16
-#define LOCAL_Y 8
+
+// use_guess of optical_flow_2 and optical_flow_buffer: no initial guess, the flow of the next
+// coarser pyramid level (half resolution) or a prediction at the resolution of this level
+#define GUESS_NONE 0
+#define GUESS_PYRAMID 1
+#define GUESS_TEMPORAL 2
+// Work-group size of the kernels with local memory tiles. Always set with -D from the tuning
+// table of the host (TuningTable::getProgramOptions), both have to be at least 2*FRAD so the
+// halo is loaded completely.
+#if !defined(LOCAL_X) || !defined(LOCAL_Y)
+#error "LOCAL_X and LOCAL_Y have to be defined with -D"
+#endif
 
 __kernel void optical_flow( 
     __read_only image2d_t I,
@@ -248,7 +329,9 @@ __kernel void optical_flow_2(
     __read_only image2d_t guess_in,
     __write_only image2d_t guess_out,
     int guess_width,
-	int guess_height )
+	int guess_height,
+    int max_iterations,
+    __write_only image2d_t iterations_out )
 {
     // Create sampler objects.  One is for nearest neighbour, the other fo
     // bilinear interpolation
@@ -261,9 +344,9 @@ __kernel void optical_flow_2(
 
 						   
     // declare some shared memory
-    __local int smem[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
-    __local int smemIy[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
-    __local int smemIx[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
+    __local channeli smem[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
+    __local channeli smemIy[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
+    __local channeli smemIx[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
 
     // Image indices. Note for the texture, we offset by 0.5 to use the centre
     // of the texel. 
@@ -273,27 +356,27 @@ __kernel void optical_flow_2(
 	// load some data into local memory because it will be re-used frequently
     // load upper left region of smem
     int2 tIdx = { get_local_id(0), get_local_id(1) }; // 0..15, 0..7
-    smem[ tIdx.y ][ tIdx.x ] = read_imageui( I, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ).x;
-    smemIy[ tIdx.y ][ tIdx.x ] = read_imageui( Iy, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ).x;
-    smemIx[ tIdx.y ][ tIdx.x ] = read_imageui( Ix, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ).x;
+    smem[ tIdx.y ][ tIdx.x ] = PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ));
+    smemIy[ tIdx.y ][ tIdx.x ] = PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ));
+    smemIx[ tIdx.y ][ tIdx.x ] = PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ));
 
     // upper right
     if( tIdx.x < 2*FRAD ) { 
-            smem[ tIdx.y ][ tIdx.x + LOCAL_X ] = read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ).x;
-            smemIy[ tIdx.y ][ tIdx.x + LOCAL_X ] = read_imageui( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ).x;
-            smemIx[ tIdx.y ][ tIdx.x + LOCAL_X ] = read_imageui( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ).x;
+            smem[ tIdx.y ][ tIdx.x + LOCAL_X ] = PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ));
+            smemIy[ tIdx.y ][ tIdx.x + LOCAL_X ] = PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ));
+            smemIx[ tIdx.y ][ tIdx.x + LOCAL_X ] = PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ));
     }
     // lower left
     if( tIdx.y < 2*FRAD ) {
-            smem[ tIdx.y + LOCAL_Y ][ tIdx.x ] = read_imageui( I, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ).x;
-            smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x ] = read_imageui( Iy, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ).x;
-            smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x ] = read_imageui( Ix, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ).x;
+            smem[ tIdx.y + LOCAL_Y ][ tIdx.x ] = PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ));
+            smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x ] = PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ));
+            smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x ] = PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ));
     }
     // lower right
     if( tIdx.x < 2*FRAD && tIdx.y < 2*FRAD ) {
-            smem[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ).x;
-            smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = read_imageui( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ).x;
-            smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = read_imageui( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ).x;
+            smem[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ));
+            smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ));
+            smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ));
     }
     barrier(CLK_LOCAL_MEM_FENCE);
 	if (iIidx.x >= guess_width || iIidx.y >= guess_height)
@@ -304,7 +387,7 @@ __kernel void optical_flow_2(
     float2 g = {0,0}; 
 
         // Previous pyramid levels provide input guess.  Use if available.
-    if (use_guess != 0)
+    if (use_guess == GUESS_PYRAMID)
 	{
         //lookup in higher level, div by two to find position because its smaller
         int2 gin_pos = { iIidx.x/2, iIidx.y/2 };
@@ -313,6 +396,11 @@ __kernel void optical_flow_2(
         g.x = g_in.x * 2;
         g.y = g_in.y * 2;
     }
+    else if (use_guess == GUESS_TEMPORAL)
+    {
+        // flow predicted from the previous frame pair, same resolution as this level
+        g = read_imagef(guess_in, nnSampler, iIidx).xy;
+    }
 
     float2 v = {0,0};
     
@@ -327,7 +415,9 @@ __kernel void optical_flow_2(
 
     // for large motions we can approximate them faster by applying gain to the motion
     float gain = 4.0f;
-    for (int k=0 ; k < 8 ; k++)
+    // max_iterations + 1 marks a pixel that did not converge
+    int iterations = max_iterations + 1;
+    for (int k=0 ; k < max_iterations ; k++)
 	{
         float2 Jidx = { Iidx.x + g.x + v.x, Iidx.y + g.y + v.y };
         float2 b = {0,0};
@@ -339,14 +429,15 @@ __kernel void optical_flow_2(
             for (int i = -FRAD; i <= FRAD; i++) 
 			{
                 // this should use shared memory instead...
-                int Isample = smem[tIdx.y + FRAD +j][tIdx.x + FRAD+ i];
-                int Jsample = read_imageui(J, bilinSampler, Jidx+(float2)(i,j)).x;
-                float dIk = (float)Isample - Jsample;
+                channeli Isample = smem[tIdx.y + FRAD +j][tIdx.x + FRAD+ i];
+                channelf Jsample = PIXEL_F(read_imageui(J, bilinSampler, Jidx+(float2)(i,j)));
+                channelf dIk = CHANNEL_F(Isample) - Jsample;
 
-                int ix = smemIx[tIdx.y + FRAD +j][tIdx.x + FRAD+ i]; 
-                int iy = smemIy[tIdx.y + FRAD +j][tIdx.x + FRAD+ i]; 
+                channelf ix = CHANNEL_F(smemIx[tIdx.y + FRAD +j][tIdx.x + FRAD+ i]); 
+                channelf iy = CHANNEL_F(smemIy[tIdx.y + FRAD +j][tIdx.x + FRAD+ i]); 
 
-                b += (float2)(dIk * ix * gain, dIk * iy * gain);
+                // summed over the channels, averaged like G in filter_G
+                b += (float2)(SUM_COLOR(dIk * ix), SUM_COLOR(dIk * iy)) * (gain / COLOR_CHANNELS);
             }
         }
 
@@ -362,7 +453,10 @@ __kernel void optical_flow_2(
         // break if no motion
         // on test images this changes from 74 ms if no break, 55 if break, on minicooper, k=8, FRAD=4, gain=4
         if (length(n) < 0.004) 
+		{
+			iterations = k + 1;
 			break;
+		}
 
         // guess for next iteration: v_new = v_current + n
         v = v + n;
@@ -371,5 +465,1139 @@ __kernel void optical_flow_2(
     int2 outCoords = { get_global_id(0), get_global_id(1) }; 
 
     write_imagef(guess_out, outCoords, (float4)(v.x + g.x, v.y + g.y, 0.0f, 0.0f));
+    write_imageui(iterations_out, outCoords, (uint4)(iterations, 0, 0, 0));
+}
+
+// Loads one row of 2*FRAD+2 pixels of J starting at (x, y) into private memory. If the row lies
+// completely inside the image the pixels are fetched with vector loads, otherwise every pixel is
+// clamped to the edge like CLK_ADDRESS_CLAMP_TO_EDGE does for images.
+inline void load_J_row(__global const uchar* J, int width, int height, int x, int y, bool inside, channelf* row)
+{
+    if (inside)
+    {
+#if CHANNELS == 4
+        // one 32 bit load per pixel
+        for (int i = 0; i < 2*FRAD + 2; i++)
+            row[i] = convert_float4(vload4(y * width + x + i, J));
+#elif FRAD == 4
+        __global const uchar* src = J + y * width + x;
+        float8 first = convert_float8(vload8(0, src));
+        float2 last = convert_float2(vload2(0, src + 8));
+        vstore8(first, 0, row);
+        vstore2(last, 0, row + 8);
+#else
+        __global const uchar* src = J + y * width + x;
+        for (int i = 0; i < 2*FRAD + 2; i++)
+            row[i] = src[i];
+#endif
+    }
+    else
+    {
+        int rowStart = clamp(y, 0, height - 1) * width;
+        for (int i = 0; i < 2*FRAD + 2; i++)
+        {
+            int index = rowStart + clamp(x + i, 0, width - 1);
+#if CHANNELS == 4
+            row[i] = convert_float4(vload4(index, J));
+#else
+            row[i] = J[index];
+#endif
+        }
+    }
+}
+
+// Same as optical_flow_2, but J is a plain buffer (width * height pixels, no padding) and the
+// bilinear interpolation is done in float instead of by the image sampler. All samples of the
+// window share the same fractional offset, so the four weights are computed once per iteration
+// and every sample costs four multiply-adds. Each row of J is loaded only once and is reused as
+// the upper row of the next sample row.
+__kernel void optical_flow_buffer( 
+    __read_only image2d_t I,
+    __read_only image2d_t Ix,
+    __read_only image2d_t Iy,
+    __read_only image2d_t G,
+    __global const uchar* J,
+	int use_guess,
+    __read_only image2d_t guess_in,
+    __write_only image2d_t guess_out,
+    int guess_width,
+	int guess_height,
+    int max_iterations,
+    __write_only image2d_t iterations_out )
+{
+    sampler_t nnSampler = CLK_NORMALIZED_COORDS_FALSE |
+                           CLK_ADDRESS_CLAMP_TO_EDGE |
+                           CLK_FILTER_NEAREST ;
+
+    __local channeli smem[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
+    __local channeli smemIy[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
+    __local channeli smemIx[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
+
+    int2 iIidx = { get_global_id(0), get_global_id(1)};
+    float2 Iidx = { get_global_id(0)+0.5, get_global_id(1)+0.5 };
+
+    int2 tIdx = { get_local_id(0), get_local_id(1) };
+    smem[ tIdx.y ][ tIdx.x ] = PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ));
+    smemIy[ tIdx.y ][ tIdx.x ] = PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ));
+    smemIx[ tIdx.y ][ tIdx.x ] = PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ));
+
+    // upper right
+    if( tIdx.x < 2*FRAD ) { 
+            smem[ tIdx.y ][ tIdx.x + LOCAL_X ] = PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ));
+            smemIy[ tIdx.y ][ tIdx.x + LOCAL_X ] = PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ));
+            smemIx[ tIdx.y ][ tIdx.x + LOCAL_X ] = PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ));
+    }
+    // lower left
+    if( tIdx.y < 2*FRAD ) {
+            smem[ tIdx.y + LOCAL_Y ][ tIdx.x ] = PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ));
+            smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x ] = PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ));
+            smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x ] = PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ));
+    }
+    // lower right
+    if( tIdx.x < 2*FRAD && tIdx.y < 2*FRAD ) {
+            smem[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ));
+            smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ));
+            smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+	if (iIidx.x >= guess_width || iIidx.y >= guess_height)
+	{ 
+		return;
+	}
+
+    float2 g = {0,0}; 
+
+    if (use_guess == GUESS_PYRAMID)
+	{
+        int2 gin_pos = { iIidx.x/2, iIidx.y/2 };
+        float2 g_in = read_imagef(guess_in, nnSampler, gin_pos).xy;
+        g.x = g_in.x * 2;
+        g.y = g_in.y * 2;
+    }
+    else if (use_guess == GUESS_TEMPORAL)
+    {
+        g = read_imagef(guess_in, nnSampler, iIidx).xy;
+    }
+
+    float2 v = {0,0};
+    
+    int4 Gmat = read_imagei(G, nnSampler, iIidx);
+    float det_G = (float)Gmat.s0 * (float)Gmat.s3 - (float)Gmat.s1 * (float)Gmat.s2 ;
+    if (det_G == 0.0f) 
+	    det_G = eps;
+
+    float4 Ginv = { Gmat.s3/det_G, -Gmat.s1/det_G, -Gmat.s2/det_G, Gmat.s0/det_G };
+
+    float gain = 4.0f;
+    // max_iterations + 1 marks a pixel that did not converge
+    int iterations = max_iterations + 1;
+    for (int k=0 ; k < max_iterations ; k++)
+	{
+        // Texel centers are at +0.5, so the upper left texel of the bilinear footprint is floor(Jidx - 0.5)
+        float2 Jpos = { iIidx.x + g.x + v.x, iIidx.y + g.y + v.y };
+        float2 Jfloor = floor(Jpos);
+        float2 f = Jpos - Jfloor;
+        int2 J0 = convert_int2(Jfloor) - (int2)(FRAD, FRAD);
+
+        float w00 = (1.0f - f.x) * (1.0f - f.y);
+        float w10 = f.x * (1.0f - f.y);
+        float w01 = (1.0f - f.x) * f.y;
+        float w11 = f.x * f.y;
+
+        bool inside = J0.x >= 0 && J0.x + 2*FRAD + 1 < guess_width &&
+                      J0.y >= 0 && J0.y + 2*FRAD + 1 < guess_height;
+
+        channelf upper[2*FRAD + 2];
+        channelf lower[2*FRAD + 2];
+        load_J_row(J, guess_width, guess_height, J0.x, J0.y, inside, upper);
+
+        float2 b = {0,0};
+        float2 n = {0,0};
+
+        // calculate the mismatch vector
+        for (int j = -FRAD; j <= FRAD; j++) 
+		{
+            load_J_row(J, guess_width, guess_height, J0.x, J0.y + FRAD + j + 1, inside, lower);
+
+            for (int i = -FRAD; i <= FRAD; i++) 
+			{
+                channeli Isample = smem[tIdx.y + FRAD +j][tIdx.x + FRAD+ i];
+                channelf Jsample = w00 * upper[FRAD + i] + w10 * upper[FRAD + i + 1]
+                                 + w01 * lower[FRAD + i] + w11 * lower[FRAD + i + 1];
+                channelf dIk = CHANNEL_F(Isample) - Jsample;
+
+                channelf ix = CHANNEL_F(smemIx[tIdx.y + FRAD +j][tIdx.x + FRAD+ i]); 
+                channelf iy = CHANNEL_F(smemIy[tIdx.y + FRAD +j][tIdx.x + FRAD+ i]); 
+
+                b += (float2)(SUM_COLOR(dIk * ix), SUM_COLOR(dIk * iy)) * (gain / COLOR_CHANNELS);
+            }
+
+            for (int i = 0; i < 2*FRAD + 2; i++)
+                upper[i] = lower[i];
+        }
+
+        n = (float2)(Ginv.s0*b.s0 + Ginv.s1*b.s1,  Ginv.s2*b.s0 + Ginv.s3*b.s1);
+
+        if (fabs(det_G) < 1000) 
+			n = (float2)(0,0);
+
+        if (length(n) < 0.004) 
+		{
+			iterations = k + 1;
+			break;
+		}
+
+        v = v + n;
+    }
+
+    int2 outCoords = { get_global_id(0), get_global_id(1) }; 
+
+    write_imagef(guess_out, outCoords, (float4)(v.x + g.x, v.y + g.y, 0.0f, 0.0f));
+    write_imageui(iterations_out, outCoords, (uint4)(iterations, 0, 0, 0));
+}
+
+// Fixed point formats of optical_flow_fixed:
+//   flow and positions        Q8, 1/256 pixel, its fraction is used for the bilinear weights
+//   bilinear weights          Q16, the product of two Q8 fractions, exact for a Q8 position
+//   I, J samples and mismatch Q4, 1/16 gray level, at most 255 * 16 = 4080
+//   Scharr derivatives        integer as computed, at most 16 * 255 = 4080
+// Samples and derivatives fit in 13 bits signed, so the tiles in local memory are shorts, every
+// product of the mismatch is a 24 bit multiply and the window sum of 81 products (at most
+// 81 * 4080 * 4080 = 1.35e9) fits in 32 bits per channel. This needs FRAD <= 4 like filter_G.
+// No 64 bit integers are used, they are optional in the embedded profile and this kernel is
+// compiled into the same program as all others.
+#define FIXED_POS_BITS 8
+#define FIXED_DIFF_BITS 4
+#define FIXED_POS_ONE (1 << FIXED_POS_BITS)
+
+// The gain of 4 of the float kernels
+#define FIXED_GAIN_BITS 2
+
+// Updates are clamped to 128 pixels so the flow stays in 32 bits, the float kernels do not clamp
+#define FIXED_MAX_UPDATE (128 << FIXED_POS_BITS)
+
+// Shift from the Q4 mismatch to the Q8 update, including the gain
+#define FIXED_SOLVE_SHIFT (FIXED_POS_BITS - FIXED_DIFF_BITS + FIXED_GAIN_BITS)
+
+// Integer version of load_J_row
+inline void load_J_row_fixed(__global const uchar* J, int width, int height, int x, int y, bool inside, channeli* row)
+{
+    if (inside)
+    {
+#if CHANNELS == 4
+        for (int i = 0; i < 2*FRAD + 2; i++)
+            row[i] = convert_int4(vload4(y * width + x + i, J));
+#elif FRAD == 4
+        __global const uchar* src = J + y * width + x;
+        vstore8(convert_int8(vload8(0, src)), 0, row);
+        vstore2(convert_int2(vload2(0, src + 8)), 0, row + 8);
+#else
+        __global const uchar* src = J + y * width + x;
+        for (int i = 0; i < 2*FRAD + 2; i++)
+            row[i] = src[i];
+#endif
+    }
+    else
+    {
+        int rowStart = clamp(y, 0, height - 1) * width;
+        for (int i = 0; i < 2*FRAD + 2; i++)
+        {
+            int index = rowStart + clamp(x + i, 0, width - 1);
+#if CHANNELS == 4
+            row[i] = convert_int4(vload4(index, J));
+#else
+            row[i] = J[index];
+#endif
+        }
+    }
+}
+
+// Q-format inverse of G, computed once per pixel. G is rounded to 15 bits and 1/det(G) to a
+// 15 bit reciprocal, so the entries of the inverse are mantissas below 2^30 with a common
+// exponent: G^-1 * 2^FIXED_SOLVE_SHIFT = inverse * 2^-exponent. Returns false for the
+// determinants the float kernels suppress (below 1000).
+inline bool fixed_invert(int4 Gmat, int4* inverse, int* exponent)
+{
+    uint largest = max((uint)max(Gmat.s0, Gmat.s3), max(abs(Gmat.s1), abs(Gmat.s2)));
+    int shiftG = max(0, 32 - (int)clz(largest) - 15);
+    int4 g = Gmat / (1 << shiftG);
+
+    // |g| < 2^15, so the determinant fits in 32 bits. G is positive semi-definite, a negative
+    // determinant only comes from rounding.
+    int det = g.s0 * g.s3 - g.s1 * g.s2;
+    if (det <= 0 || (shiftG < 5 && det < (1000 >> (2 * shiftG))))
+        return false;
+
+    // Normalized to [2^15, 2^16), the reciprocal is in (2^14, 2^15]
+    int shiftD = 32 - (int)clz((uint)det) - 16;
+    int normalized = (shiftD >= 0) ? det >> shiftD : det << -shiftD;
+    int reciprocal = (1 << 30) / normalized;
+
+    *inverse = (int4)(g.s3, -g.s1, -g.s2, g.s0) * reciprocal;
+    *exponent = 30 + shiftD + shiftG - FIXED_SOLVE_SHIFT;
+    return true;
+}
+
+// value * 2^-shift rounded to the nearest integer and clamped to FIXED_MAX_UPDATE. The sign
+// is handled separately because right shifts of negative values are implementation-defined.
+inline int fixed_scale(int value, int shift)
+{
+    uint magnitude = abs(value);
+    if (magnitude == 0)
+        return 0;
+
+    if (shift > 0)
+        magnitude = (shift < 31) ? (magnitude + (1u << (shift - 1))) >> shift : 0;
+    else if (-shift < 16 && magnitude <= (uint)(FIXED_MAX_UPDATE >> -shift))
+        magnitude <<= -shift;
+    else
+        magnitude = FIXED_MAX_UPDATE;
+
+    magnitude = min(magnitude, (uint)FIXED_MAX_UPDATE);
+    return (value < 0) ? -(int)magnitude : (int)magnitude;
+}
+
+// Update n = G^-1 * b in Q8 with 32 bit multiply-high and shifts only. b is normalized to 30
+// bits first, so every product keeps about 28 significant bits.
+inline int2 fixed_solve(int4 inverse, int exponent, int b0, int b1)
+{
+    uint largest = max(abs(b0), abs(b1));
+    if (largest == 0)
+        return (int2)(0, 0);
+
+    int shiftB = (int)clz(largest) - 2;
+    if (shiftB >= 0)
+    {
+        b0 *= 1 << shiftB;
+        b1 *= 1 << shiftB;
+    }
+    else
+    {
+        b0 /= 2;
+        b1 /= 2;
+    }
+
+    int2 p = (int2)(mul_hi(inverse.s0, b0) + mul_hi(inverse.s1, b1),
+                    mul_hi(inverse.s2, b0) + mul_hi(inverse.s3, b1));
+    int shift = exponent + shiftB - 32;
+    return (int2)(fixed_scale(p.x, shift), fixed_scale(p.y, shift));
+}
+
+// Same as optical_flow_buffer, but in integer arithmetic for devices with much higher integer
+// than float throughput. The inverse of G is computed once per pixel in Q-format, the solve in
+// every iteration is four 32 bit multiply-high and a shift.
+//
+// Error against the float kernel per iteration:
+//   - the guess is rounded to Q8, at most 1/512 pixel per component
+//   - every J sample is rounded to Q4, at most 1/32 gray level, the float kernel keeps the full
+//     interpolated value
+//   - the inverse of G has 15 bit mantissas, a relative error of the update of about 2^-13
+//     times the condition number of G, the float kernel computes det(G) with 24 bits
+//   - the update is rounded to nearest, at most 1/512 pixel per component
+//   - the iteration stops at an update of at most one Q8 step (0.0039 pixel), the float kernel
+//     at a length below 0.004 pixel
+// Since every iteration measures the mismatch at the current position again, the errors do not
+// add up over iterations or levels. The remaining difference of the converged flow is in the
+// order of the stop threshold, benchmarkFixedPoint reports the measured difference.
+__kernel void optical_flow_fixed( 
+    __read_only image2d_t I,
+    __read_only image2d_t Ix,
+    __read_only image2d_t Iy,
+    __read_only image2d_t G,
+    __global const uchar* J,
+	int use_guess,
+    __read_only image2d_t guess_in,
+    __write_only image2d_t guess_out,
+    int guess_width,
+	int guess_height,
+    int max_iterations,
+    __write_only image2d_t iterations_out )
+{
+    sampler_t nnSampler = CLK_NORMALIZED_COORDS_FALSE |
+                           CLK_ADDRESS_CLAMP_TO_EDGE |
+                           CLK_FILTER_NEAREST ;
+
+    // I is stored in Q4 so the mismatch needs no further shift
+    __local channels smem[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
+    __local channels smemIy[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
+    __local channels smemIx[2*FRAD + LOCAL_Y][2*FRAD + LOCAL_X] ;
+
+    int2 iIidx = { get_global_id(0), get_global_id(1)};
+    float2 Iidx = { get_global_id(0)+0.5, get_global_id(1)+0.5 };
+
+    int2 tIdx = { get_local_id(0), get_local_id(1) };
+    smem[ tIdx.y ][ tIdx.x ] = CHANNEL_S(PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(-FRAD,-FRAD) )) << FIXED_DIFF_BITS);
+    smemIy[ tIdx.y ][ tIdx.x ] = CHANNEL_S(PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(-FRAD,-FRAD) )));
+    smemIx[ tIdx.y ][ tIdx.x ] = CHANNEL_S(PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(-FRAD,-FRAD) )));
+
+    // upper right
+    if( tIdx.x < 2*FRAD ) { 
+            smem[ tIdx.y ][ tIdx.x + LOCAL_X ] = CHANNEL_S(PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) )) << FIXED_DIFF_BITS);
+            smemIy[ tIdx.y ][ tIdx.x + LOCAL_X ] = CHANNEL_S(PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) )));
+            smemIx[ tIdx.y ][ tIdx.x + LOCAL_X ] = CHANNEL_S(PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) )));
+    }
+    // lower left
+    if( tIdx.y < 2*FRAD ) {
+            smem[ tIdx.y + LOCAL_Y ][ tIdx.x ] = CHANNEL_S(PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) )) << FIXED_DIFF_BITS);
+            smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x ] = CHANNEL_S(PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) )));
+            smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x ] = CHANNEL_S(PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) )));
+    }
+    // lower right
+    if( tIdx.x < 2*FRAD && tIdx.y < 2*FRAD ) {
+            smem[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = CHANNEL_S(PIXEL_UI(read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) )) << FIXED_DIFF_BITS);
+            smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = CHANNEL_S(PIXEL_I(read_imagei( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) )));
+            smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = CHANNEL_S(PIXEL_I(read_imagei( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) )));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+	if (iIidx.x >= guess_width || iIidx.y >= guess_height)
+	{ 
+		return;
+	}
+
+    float2 guess = {0,0}; 
+
+    if (use_guess == GUESS_PYRAMID)
+	{
+        int2 gin_pos = { iIidx.x/2, iIidx.y/2 };
+        guess = read_imagef(guess_in, nnSampler, gin_pos).xy * 2.0f;
+    }
+    else if (use_guess == GUESS_TEMPORAL)
+    {
+        guess = read_imagef(guess_in, nnSampler, iIidx).xy;
+    }
+
+    int2 g = convert_int2_rte(guess * FIXED_POS_ONE);
+    int2 v = {0,0};
+
+    int4 Gmat = read_imagei(G, nnSampler, iIidx);
+    int4 inverse;
+    int exponent;
+
+    // The float kernels suppress the motion for the same determinants and stop after one iteration
+    int iterations = 1;
+    if (fixed_invert(Gmat, &inverse, &exponent))
+    {
+        iterations = max_iterations + 1;
+        for (int k=0 ; k < max_iterations ; k++)
+        {
+            // The fraction is taken with a mask so negative positions are floored as well
+            int2 Jpos = iIidx * FIXED_POS_ONE + g + v;
+            int2 f = Jpos & (FIXED_POS_ONE - 1);
+            int2 J0 = (Jpos - f) / FIXED_POS_ONE - (int2)(FRAD, FRAD);
+
+            int w00 = (FIXED_POS_ONE - f.x) * (FIXED_POS_ONE - f.y);
+            int w10 = f.x * (FIXED_POS_ONE - f.y);
+            int w01 = (FIXED_POS_ONE - f.x) * f.y;
+            int w11 = f.x * f.y;
+
+            bool inside = J0.x >= 0 && J0.x + 2*FRAD + 1 < guess_width &&
+                          J0.y >= 0 && J0.y + 2*FRAD + 1 < guess_height;
+
+            channeli upper[2*FRAD + 2];
+            channeli lower[2*FRAD + 2];
+            load_J_row_fixed(J, guess_width, guess_height, J0.x, J0.y, inside, upper);
+
+            channeli bx = 0;
+            channeli by = 0;
+
+            // calculate the mismatch vector, per channel to stay in 32 bits
+            for (int j = -FRAD; j <= FRAD; j++) 
+            {
+                load_J_row_fixed(J, guess_width, guess_height, J0.x, J0.y + FRAD + j + 1, inside, lower);
+
+                for (int i = -FRAD; i <= FRAD; i++) 
+                {
+                    // Q16, rounded to Q4, the samples are never negative
+                    channeli Jsample = w00 * upper[FRAD + i] + w10 * upper[FRAD + i + 1]
+                                     + w01 * lower[FRAD + i] + w11 * lower[FRAD + i + 1];
+                    Jsample = (Jsample + (1 << (2*FIXED_POS_BITS - FIXED_DIFF_BITS - 1))) >> (2*FIXED_POS_BITS - FIXED_DIFF_BITS);
+                    channeli dIk = CHANNEL_I(smem[tIdx.y + FRAD +j][tIdx.x + FRAD+ i]) - Jsample;
+
+                    bx = mad24(dIk, CHANNEL_I(smemIx[tIdx.y + FRAD +j][tIdx.x + FRAD+ i]), bx);
+                    by = mad24(dIk, CHANNEL_I(smemIy[tIdx.y + FRAD +j][tIdx.x + FRAD+ i]), by);
+                }
+
+                for (int i = 0; i < 2*FRAD + 2; i++)
+                    upper[i] = lower[i];
+            }
+
+            // averaged over the color channels like G in filter_G
+            int b0 = AVERAGE_COLOR(bx);
+            int b1 = AVERAGE_COLOR(by);
+
+            int2 n = fixed_solve(inverse, exponent, b0, b1);
+
+            if (abs(n.x) + abs(n.y) <= 1)
+            {
+                iterations = k + 1;
+                break;
+            }
+
+            v = v + n;
+        }
+    }
+
+    int2 outCoords = { get_global_id(0), get_global_id(1) }; 
+    float2 flow = convert_float2(g + v) / FIXED_POS_ONE;
+
+    write_imagef(guess_out, outCoords, (float4)(flow.x, flow.y, 0.0f, 0.0f));
+    write_imageui(iterations_out, outCoords, (uint4)(iterations, 0, 0, 0));
+}
+
+// Largest window radius of the flow post filters (5x5)
+#define POST_RADIUS 2
+
+// Vector median filter on the flow field with a radius of 1 (3x3) or 2 (5x5). The output is the
+// vector of the window with the smallest summed L1 distance to all other vectors of the window.
+// Must be launched with a local size of LOCAL_X x LOCAL_Y.
+__kernel
+void flow_median(__read_only image2d_t flow,
+                 __write_only image2d_t output,
+                 int radius)
+{
+    __local float2 tile[LOCAL_Y + 2*POST_RADIUS][LOCAL_X + 2*POST_RADIUS];
+
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int baseX = get_group_id(0) * LOCAL_X - POST_RADIUS;
+    const int baseY = get_group_id(1) * LOCAL_Y - POST_RADIUS;
+
+    for (int ty = ly; ty < LOCAL_Y + 2*POST_RADIUS; ty += LOCAL_Y)
+        for (int tx = lx; tx < LOCAL_X + 2*POST_RADIUS; tx += LOCAL_X)
+            tile[ty][tx] = read_imagef(flow, sampler, (int2)(baseX + tx, baseY + ty)).xy;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (ix >= get_image_width(output) || iy >= get_image_height(output))
+        return;
+
+    float2 best = tile[ly + POST_RADIUS][lx + POST_RADIUS];
+    float bestDistance = MAXFLOAT;
+    for (int cy = -radius; cy <= radius; cy++)
+    {
+        for (int cx = -radius; cx <= radius; cx++)
+        {
+            float2 candidate = tile[ly + POST_RADIUS + cy][lx + POST_RADIUS + cx];
+            float distance = 0.0f;
+            for (int y = -radius; y <= radius; y++)
+            {
+                for (int x = -radius; x <= radius; x++)
+                {
+                    float2 d = fabs(candidate - tile[ly + POST_RADIUS + y][lx + POST_RADIUS + x]);
+                    distance += d.x + d.y;
+                }
+            }
+
+            if (distance < bestDistance)
+            {
+                bestDistance = distance;
+                best = candidate;
+            }
+        }
+    }
+
+    write_imagef(output, (int2)(ix, iy), (float4)(best.x, best.y, 0.0f, 0.0f));
+}
+
+// Edge-aware smoothing of the flow field. Every vector of the 5x5 window is weighted by its
+// spatial distance and by the intensity difference in the guide image, so motion does not
+// bleed across object borders.
+__kernel
+void flow_bilateral(__read_only image2d_t flow,
+                    __read_only image2d_t guide,
+                    __write_only image2d_t output,
+                    float sigma_space,
+                    float sigma_color)
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+
+    if (ix >= get_image_width(output) || iy >= get_image_height(output))
+        return;
+
+    const float spaceFactor = -0.5f / (sigma_space * sigma_space);
+    const float colorFactor = -0.5f / (sigma_color * sigma_color);
+    const channelf center = PIXEL_F(read_imageui(guide, sampler, (int2)(ix, iy)));
+
+    float2 sum = { 0.0f, 0.0f };
+    float weightSum = 0.0f;
+    for (int y = -POST_RADIUS; y <= POST_RADIUS; y++)
+    {
+        for (int x = -POST_RADIUS; x <= POST_RADIUS; x++)
+        {
+            int2 samplePos = { ix + x, iy + y };
+            channelf dI = PIXEL_F(read_imageui(guide, sampler, samplePos)) - center;
+            float weight = exp((x*x + y*y) * spaceFactor + SUM_COLOR(dI * dI) / COLOR_CHANNELS * colorFactor);
+
+            sum += weight * read_imagef(flow, sampler, samplePos).xy;
+            weightSum += weight;
+        }
+    }
+
+    // weightSum is at least 1 because of the center sample
+    sum /= weightSum;
+    write_imagef(output, (int2)(ix, iy), (float4)(sum.x, sum.y, 0.0f, 0.0f));
+}
+
+// Bilinear upsampling of a flow field by scale. The vectors are multiplied by the same factor
+// so they are measured in pixels of the output resolution.
+__kernel
+void flow_upsample(__read_only image2d_t flow,
+                   __write_only image2d_t output,
+                   float scale)
+{
+    const sampler_t linearSampler = CLK_NORMALIZED_COORDS_FALSE |
+                                    CLK_ADDRESS_CLAMP_TO_EDGE |
+                                    CLK_FILTER_LINEAR;
+
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+
+    if (ix >= get_image_width(output) || iy >= get_image_height(output))
+        return;
+
+    float2 source = ((float2)(ix, iy) + 0.5f) / scale;
+    float2 v = read_imagef(flow, linearSampler, source).xy * scale;
+
+    write_imagef(output, (int2)(ix, iy), (float4)(v.x, v.y, 0.0f, 0.0f));
+}
+
+// Box filtered downsampling of a flow field by an integer factor. The vectors are divided by the
+// same factor so they are measured in pixels of the output resolution. A factor of 1 copies.
+__kernel
+void flow_downsample(__read_only image2d_t flow,
+                     __write_only image2d_t output,
+                     int factor)
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+
+    if (ix >= get_image_width(output) || iy >= get_image_height(output))
+        return;
+
+    float2 sum = (float2)(0.0f, 0.0f);
+    for (int y = 0; y < factor; ++y)
+    {
+        for (int x = 0; x < factor; ++x)
+            sum += read_imagef(flow, sampler, (int2)(ix * factor + x, iy * factor + y)).xy;
+    }
+    float2 v = sum / (float)(factor * factor * factor);
+
+    write_imagef(output, (int2)(ix, iy), (float4)(v.x, v.y, 0.0f, 0.0f));
+}
+
+// Pixel types of the reduction and rendering kernels, an image is read with read_imageui,
+// read_imagei or read_imagef
+#define PIXEL_UNSIGNED 0
+#define PIXEL_SIGNED 1
+#define PIXEL_FLOAT 2
+
+// Channel index for the length of the first two channels, e.g. the magnitude of a flow vector
+#define MAGNITUDE_CHANNEL 4
+
+// Work-group size of the reduction kernels, the host launches them with the same local size
+#ifndef REDUCE_SIZE
+#define REDUCE_SIZE 256
+#endif
+
+#define HISTOGRAM_BINS 64
+
+inline float read_value(__read_only image2d_t image, int2 pos, int type, int channel)
+{
+    float4 pixel;
+    if (type == PIXEL_UNSIGNED)
+        pixel = convert_float4(read_imageui(image, sampler, pos));
+    else if (type == PIXEL_SIGNED)
+        pixel = convert_float4(read_imagei(image, sampler, pos));
+    else
+        pixel = read_imagef(image, sampler, pos);
+
+    switch (channel)
+    {
+    case 0: return pixel.x;
+    case 1: return pixel.y;
+    case 2: return pixel.z;
+    case 3: return pixel.w;
+    default: return length(pixel.xy);
+    }
+}
+
+// Stats are (min, max, sum, count)
+inline float4 combine_stats(float4 a, float4 b)
+{
+    return (float4)(fmin(a.x, b.x), fmax(a.y, b.y), a.z + b.z, a.w + b.w);
+}
+
+// Tree reduction of one value per work item, the result of the work-group is in stats[0]
+inline void reduce_group(__local float4* stats, float4 value)
+{
+    int lid = get_local_id(0);
+    stats[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int offset = REDUCE_SIZE / 2; offset > 0; offset /= 2)
+    {
+        if (lid < offset)
+            stats[lid] = combine_stats(stats[lid], stats[lid + offset]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// First pass of the min/max/sum reduction of one channel. Every work item accumulates pixels
+// with a stride of the global size, so neighbouring work items read neighbouring pixels. Every
+// work-group writes its stats to partial[group], reduce_stats_final combines them.
+__kernel __attribute__((reqd_work_group_size(REDUCE_SIZE, 1, 1)))
+void reduce_stats(__read_only image2d_t image,
+                  int type,
+                  int channel,
+                  __global float4* partial)
+{
+    __local float4 stats[REDUCE_SIZE];
+
+    const int width = get_image_width(image);
+    const int count = width * get_image_height(image);
+
+    float4 value = (float4)(INFINITY, -INFINITY, 0.0f, 0.0f);
+    for (int i = get_global_id(0); i < count; i += get_global_size(0))
+    {
+        float v = read_value(image, (int2)(i % width, i / width), type, channel);
+        value = combine_stats(value, (float4)(v, v, v, 1.0f));
+    }
+
+    reduce_group(stats, value);
+    if (get_local_id(0) == 0)
+        partial[get_group_id(0)] = stats[0];
+}
+
+// Second pass, launched with a single work-group
+__kernel __attribute__((reqd_work_group_size(REDUCE_SIZE, 1, 1)))
+void reduce_stats_final(__global const float4* partial,
+                        int count,
+                        __global float4* result)
+{
+    __local float4 stats[REDUCE_SIZE];
+
+    float4 value = (float4)(INFINITY, -INFINITY, 0.0f, 0.0f);
+    for (int i = get_local_id(0); i < count; i += REDUCE_SIZE)
+        value = combine_stats(value, partial[i]);
+
+    reduce_group(stats, value);
+    if (get_local_id(0) == 0)
+        result[0] = stats[0];
+}
+
+__kernel
+void histogram_clear(__global uint* bins)
+{
+    bins[get_global_id(0)] = 0;
+}
+
+// Histogram of one channel over the range found by reduce_stats_final. Every work-group counts
+// in local memory and adds its bins to the global histogram once.
+__kernel __attribute__((reqd_work_group_size(REDUCE_SIZE, 1, 1)))
+void histogram(__read_only image2d_t image,
+               int type,
+               int channel,
+               __global const float4* stats,
+               __global uint* bins)
+{
+    __local uint localBins[HISTOGRAM_BINS];
+
+    const int lid = get_local_id(0);
+    for (int i = lid; i < HISTOGRAM_BINS; i += REDUCE_SIZE)
+        localBins[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const float4 range = stats[0];
+    const float scale = (range.y > range.x) ? HISTOGRAM_BINS / (range.y - range.x) : 0.0f;
+    const int width = get_image_width(image);
+    const int count = width * get_image_height(image);
+    for (int i = get_global_id(0); i < count; i += get_global_size(0))
+    {
+        float v = read_value(image, (int2)(i % width, i / width), type, channel);
+        int bin = clamp((int)((v - range.x) * scale), 0, HISTOGRAM_BINS - 1);
+        atomic_inc(&localBins[bin]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = lid; i < HISTOGRAM_BINS; i += REDUCE_SIZE)
+    {
+        if (localBins[i] != 0)
+            atomic_add(&bins[i], localBins[i]);
+    }
+}
+
+// Sums the iterations of one flow level and counts the pixels which did not converge within
+// max_iterations, the flow kernels write max_iterations + 1 for them. Every work-group adds its sums to counts[2 * level] and counts[2 * level + 1] with one atomic
+// each, the counts are cleared with histogram_clear before.
+__kernel __attribute__((reqd_work_group_size(REDUCE_SIZE, 1, 1)))
+void count_iterations(__read_only image2d_t iterations,
+                      int max_iterations,
+                      int level,
+                      __global uint* counts)
+{
+    __local uint2 sums[REDUCE_SIZE];
+
+    const int lid = get_local_id(0);
+    const int width = get_image_width(iterations);
+    const int count = width * get_image_height(iterations);
+
+    uint2 value = (uint2)(0, 0);
+    for (int i = get_global_id(0); i < count; i += get_global_size(0))
+    {
+        int n = read_imageui(iterations, sampler, (int2)(i % width, i / width)).x;
+        value += (uint2)(min(n, max_iterations), (n > max_iterations) ? 1 : 0);
+    }
+
+    sums[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int offset = REDUCE_SIZE / 2; offset > 0; offset /= 2)
+    {
+        if (lid < offset)
+            sums[lid] += sums[lid + offset];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0)
+    {
+        atomic_add(&counts[2 * level], sums[0].x);
+        atomic_add(&counts[2 * level + 1], sums[0].y);
+    }
+}
+
+// The render kernels write tightly packed 8 bit RGB to a buffer of width * height * 3 bytes
+
+// One channel of an image scaled from the range found by reduce_stats_final to 0..255
+__kernel
+void render_normalized(__read_only image2d_t image,
+                       int type,
+                       int channel,
+                       __global const float4* stats,
+                       __global uchar* output)
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+    const int width = get_image_width(image);
+
+    if (ix >= width || iy >= get_image_height(image))
+        return;
+
+    const float4 range = stats[0];
+    float v = read_value(image, (int2)(ix, iy), type, channel);
+    float t = (range.y > range.x) ? (v - range.x) / (range.y - range.x) : 0.0f;
+    uchar gray = convert_uchar_sat(t * 255.0f);
+
+    vstore3((uchar3)(gray, gray, gray), iy * width + ix, output);
+}
+
+// Color wheel of the Middlebury flow benchmark (Baker et al.): red, yellow, green, cyan,
+// blue and magenta with the given number of steps between them
+#define WHEEL_RY 15
+#define WHEEL_YG 6
+#define WHEEL_GC 4
+#define WHEEL_CB 11
+#define WHEEL_BM 13
+#define WHEEL_MR 6
+#define WHEEL_COLORS (WHEEL_RY + WHEEL_YG + WHEEL_GC + WHEEL_CB + WHEEL_BM + WHEEL_MR)
+
+inline float3 wheel_color(int k)
+{
+    if (k < WHEEL_RY)
+        return (float3)(1.0f, (float)k / WHEEL_RY, 0.0f);
+    k -= WHEEL_RY;
+    if (k < WHEEL_YG)
+        return (float3)(1.0f - (float)k / WHEEL_YG, 1.0f, 0.0f);
+    k -= WHEEL_YG;
+    if (k < WHEEL_GC)
+        return (float3)(0.0f, 1.0f, (float)k / WHEEL_GC);
+    k -= WHEEL_GC;
+    if (k < WHEEL_CB)
+        return (float3)(0.0f, 1.0f - (float)k / WHEEL_CB, 1.0f);
+    k -= WHEEL_CB;
+    if (k < WHEEL_BM)
+        return (float3)((float)k / WHEEL_BM, 0.0f, 1.0f);
+    k -= WHEEL_BM;
+    return (float3)(1.0f, 0.0f, 1.0f - (float)k / WHEEL_MR);
+}
+
+// Hue is the direction of the flow, saturation the magnitude relative to the largest magnitude
+// of the field (stats of the MAGNITUDE_CHANNEL reduction)
+__kernel
+void render_flow_color(__read_only image2d_t flow,
+                       __global const float4* stats,
+                       __global uchar* output)
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+    const int width = get_image_width(flow);
+
+    if (ix >= width || iy >= get_image_height(flow))
+        return;
+
+    const float maxMagnitude = fmax(stats[0].y, 1e-6f);
+    float2 v = read_imagef(flow, sampler, (int2)(ix, iy)).xy;
+    float radius = length(v) / maxMagnitude;
+    float angle = atan2(-v.y, -v.x) / M_PI_F;
+
+    float fk = (angle + 1.0f) * 0.5f * (WHEEL_COLORS - 1);
+    int k0 = (int)fk;
+    int k1 = (k0 + 1) % WHEEL_COLORS;
+    float3 color = mix(wheel_color(k0), wheel_color(k1), fk - k0);
+
+    if (radius <= 1.0f)
+        color = 1.0f - radius * (1.0f - color);
+    else
+        color *= 0.75f;
+
+    vstore3(convert_uchar3_sat(color * 255.0f), iy * width + ix, output);
+}
+
+// Input image as background of the arrow overlay
+__kernel
+void render_base(__read_only image2d_t image,
+                 __global uchar* output)
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+    const int width = get_image_width(image);
+
+    if (ix >= width || iy >= get_image_height(image))
+        return;
+
+    uint4 pixel = read_imageui(image, sampler, (int2)(ix, iy));
+#if CHANNELS == 4
+    uchar3 rgb = convert_uchar3_sat(pixel.xyz);
+#else
+    uchar3 rgb = (uchar3)((uchar)pixel.x, (uchar)pixel.x, (uchar)pixel.x);
+#endif
+    vstore3(rgb, iy * width + ix, output);
+}
+
+// Longer vectors are shortened so a work item draws a bounded number of pixels
+#define MAX_ARROW_LENGTH 64.0f
+
+inline void plot(__global uchar* output, int width, int height, float2 pos, uchar3 color)
+{
+    int x = (int)round(pos.x);
+    int y = (int)round(pos.y);
+    if (x >= 0 && x < width && y >= 0 && y < height)
+        vstore3(color, y * width + x, output);
+}
+
+inline void draw_line(__global uchar* output, int width, int height, float2 from, float2 delta, uchar3 first, uchar3 last)
+{
+    int steps = (int)ceil(length(delta));
+    for (int i = 0; i <= steps; i++)
+    {
+        float t = (steps > 0) ? (float)i / steps : 0.0f;
+        uchar3 color = convert_uchar3_sat(mix(convert_float3(first), convert_float3(last), t));
+        plot(output, width, height, from + delta * t, color);
+    }
+}
+
+// One arrow per work item at every step-th pixel of the flow, drawn over render_base. The flow
+// has to be at the resolution of the output. Overlapping arrows overwrite each other.
+__kernel
+void render_arrows(__read_only image2d_t flow,
+                   int step,
+                   __global uchar* output)
+{
+    const int width = get_image_width(flow);
+    const int height = get_image_height(flow);
+    const int2 start = (int2)(get_global_id(0), get_global_id(1)) * step + step / 2;
+
+    if (start.x >= width || start.y >= height)
+        return;
+
+    float2 v = read_imagef(flow, sampler, start).xy;
+    float len = length(v);
+    if (len > MAX_ARROW_LENGTH)
+    {
+        v *= MAX_ARROW_LENGTH / len;
+        len = MAX_ARROW_LENGTH;
+    }
+
+    const uchar3 tail = (uchar3)(255, 0, 16);
+    const uchar3 head = (uchar3)(255, 128, 16);
+    float2 origin = convert_float2(start);
+    draw_line(output, width, height, origin, v, tail, head);
+
+    // Two strokes at +-30 degrees back from the tip
+    if (len >= 2.0f)
+    {
+        float2 back = -v / len * fmin(len / 3.0f, 4.0f);
+        const float c = 0.8660254f;
+        const float s = 0.5f;
+        float2 tip = origin + v;
+        draw_line(output, width, height, tip, (float2)(back.x * c - back.y * s, back.x * s + back.y * c), head, head);
+        draw_line(output, width, height, tip, (float2)(back.x * c + back.y * s, -back.x * s + back.y * c), head, head);
+    }
+}
+
+// Patch inverse search (DIS, Kroeger et al. 2016): instead of solving a window at every pixel,
+// patches of PATCH_SIZE x PATCH_SIZE on a grid with PATCH_STRIDE are aligned with the inverse
+// compositional Lucas-Kanade method and the dense flow is interpolated from the overlapping
+// patches. The host computes the grid with the same values.
+#ifndef PATCH_SIZE
+#define PATCH_SIZE 8
+#endif
+#ifndef PATCH_STRIDE
+#define PATCH_STRIDE 4
+#endif
+
+// The Scharr kernels are not normalized: 2 pixels distance and 3 + 10 + 3 smoothing
+#define SCHARR_SCALE 32.0f
+
+// Patches with a smaller Hessian determinant (flat or edge only) keep their initial displacement
+#define PATCH_MIN_DET 1.0f
+
+inline channelf load_J_pixel(__global const uchar* J, int index)
+{
+#if CHANNELS == 4
+    return convert_float4(vload4(index, J));
+#else
+    return J[index];
+#endif
+}
+
+// Bilinear sample of a J buffer (see optical_flow_buffer) at pixel position pos, clamped to the edge
+inline channelf sample_J(__global const uchar* J, int width, int height, float2 pos)
+{
+    float2 p0 = floor(pos);
+    float2 f = pos - p0;
+    int x0 = clamp((int)p0.x, 0, width - 1);
+    int x1 = clamp((int)p0.x + 1, 0, width - 1);
+    int y0 = clamp((int)p0.y, 0, height - 1) * width;
+    int y1 = clamp((int)p0.y + 1, 0, height - 1) * width;
+
+    channelf upper = mix(load_J_pixel(J, y0 + x0), load_J_pixel(J, y0 + x1), f.x);
+    channelf lower = mix(load_J_pixel(J, y1 + x0), load_J_pixel(J, y1 + x1), f.x);
+    return mix(upper, lower, f.y);
+}
+
+// One work item per patch. The initial displacement is the dense flow of the next coarser level
+// at the patch center. The template, its gradients and the Hessian are computed once in private
+// memory and every iteration only samples J.
+__kernel void dis_patch_search(
+    __read_only image2d_t I,
+    __read_only image2d_t Ix,
+    __read_only image2d_t Iy,
+    __global const uchar* J,
+    int use_guess,
+    __read_only image2d_t guess_in,
+    __global float2* patches,
+    int grid_width,
+    int grid_height,
+    int width,
+    int height,
+    int iterations )
+{
+    const int px = get_global_id(0);
+    const int py = get_global_id(1);
+
+    if (px >= grid_width || py >= grid_height)
+        return;
+
+    const int2 origin = (int2)(px, py) * PATCH_STRIDE;
+
+    float2 u = (float2)(0.0f, 0.0f);
+    if (use_guess == GUESS_PYRAMID)
+        u = read_imagef(guess_in, sampler, (origin + PATCH_SIZE / 2) / 2).xy * 2.0f;
+
+    // Template and gradients are constant during the search, they are read once
+    channelf templ[PATCH_SIZE * PATCH_SIZE];
+    channelf gradX[PATCH_SIZE * PATCH_SIZE];
+    channelf gradY[PATCH_SIZE * PATCH_SIZE];
+
+    float3 H = (float3)(0.0f, 0.0f, 0.0f);
+    for (int j = 0; j < PATCH_SIZE; j++)
+    {
+        for (int i = 0; i < PATCH_SIZE; i++)
+        {
+            int2 pos = origin + (int2)(i, j);
+            int index = j * PATCH_SIZE + i;
+            templ[index] = PIXEL_F(read_imageui(I, sampler, pos));
+            channelf ix = CHANNEL_F(PIXEL_I(read_imagei(Ix, sampler, pos))) / SCHARR_SCALE;
+            channelf iy = CHANNEL_F(PIXEL_I(read_imagei(Iy, sampler, pos))) / SCHARR_SCALE;
+            gradX[index] = ix;
+            gradY[index] = iy;
+            H += (float3)(SUM_COLOR(ix * ix), SUM_COLOR(ix * iy), SUM_COLOR(iy * iy));
+        }
+    }
+
+    float det = H.x * H.z - H.y * H.y;
+    if (det >= PATCH_MIN_DET)
+    {
+        float3 Hinv = (float3)(H.z, -H.y, H.x) / det;
+
+        for (int k = 0; k < iterations; k++)
+        {
+            float2 b = (float2)(0.0f, 0.0f);
+            for (int j = 0; j < PATCH_SIZE; j++)
+            {
+                for (int i = 0; i < PATCH_SIZE; i++)
+                {
+                    int2 pos = origin + (int2)(i, j);
+                    int index = j * PATCH_SIZE + i;
+                    channelf d = sample_J(J, width, height, convert_float2(pos) + u) - templ[index];
+                    b += (float2)(SUM_COLOR(d * gradX[index]), SUM_COLOR(d * gradY[index]));
+                }
+            }
+
+            // Inverse compositional update of a translation
+            float2 du = (float2)(Hinv.x * b.x + Hinv.y * b.y, Hinv.y * b.x + Hinv.z * b.y);
+            u -= du;
+
+            if (dot(du, du) < 0.0001f)
+                break;
+        }
+    }
+
+    patches[py * grid_width + px] = u;
 }
 
+// Dense flow as the average of the displacements of all patches covering a pixel, weighted by
+// the inverse photometric error of the displacement at the pixel. Pixels at the right and lower
+// border which are not covered use the nearest patch.
+__kernel void dis_densify(
+    __read_only image2d_t I,
+    __global const uchar* J,
+    __global const float2* patches,
+    __write_only image2d_t flow,
+    int grid_width,
+    int grid_height )
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+    const int width = get_image_width(flow);
+    const int height = get_image_height(flow);
+
+    if (ix >= width || iy >= height)
+        return;
+
+    const int px1 = min(grid_width - 1, ix / PATCH_STRIDE);
+    const int py1 = min(grid_height - 1, iy / PATCH_STRIDE);
+    const int px0 = clamp((ix - PATCH_SIZE + PATCH_STRIDE) / PATCH_STRIDE, 0, px1);
+    const int py0 = clamp((iy - PATCH_SIZE + PATCH_STRIDE) / PATCH_STRIDE, 0, py1);
+
+    channelf t = PIXEL_F(read_imageui(I, sampler, (int2)(ix, iy)));
+    float2 pos = (float2)(ix, iy);
+
+    float2 sum = (float2)(0.0f, 0.0f);
+    float weightSum = 0.0f;
+    for (int py = py0; py <= py1; py++)
+    {
+        for (int px = px0; px <= px1; px++)
+        {
+            float2 u = patches[py * grid_width + px];
+            channelf d = sample_J(J, width, height, pos + u) - t;
+            float weight = 1.0f / fmax(1.0f, sqrt(SUM_COLOR(d * d) / COLOR_CHANNELS));
+            sum += weight * u;
+            weightSum += weight;
+        }
+    }
+
+    float2 v = sum / weightSum;
+    write_imagef(flow, (int2)(ix, iy), (float4)(v.x, v.y, 0.0f, 0.0f));
+}
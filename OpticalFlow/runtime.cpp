@@ -113,19 +113,40 @@ void loadImage(std::string const& filename, boost::gil::gray8_image_t& image)
 	jpeg_read_image(filename, image);
 }
 
-cl::Event copyImage(cl::CommandQueue const& queue, boost::gil::gray8_image_t const& source, cl::Image2D const& target)
+void loadImage(std::string const& filename, boost::gil::rgba8_image_t& image)
+{
+	TimedEvent timer("read_image");
+	jpeg_read_and_convert_image(filename, image);
+}
+
+// Non-blocking write, the runtime reads the pixels of the source when the command executes
+template <typename ImageT>
+static cl::Event copyImagePixels(cl::CommandQueue const& queue, ImageT const& source, cl::Image2D const& target)
 {
-	TimedEvent timer("copy_image");
-	auto mappedTargetImage = mapImage(queue, target, CL_MAP_WRITE);
-	auto* mappedData = (boost::gil::gray8_pixel_t*)mappedTargetImage.data;
-	auto memoryView = boost::gil::interleaved_view(source.width(), source.height(), mappedData, mappedTargetImage.rowSize);
-	copy_pixels(boost::gil::const_view(source), memoryView);
+	auto sourceView = boost::gil::const_view(source);
+
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	region[0] = source.width();
+	region[1] = source.height();
+	region[2] = 1;
 
 	cl::Event event;
-	queue.enqueueUnmapMemObject(target, mappedData, nullptr, &event);
+	queue.enqueueWriteImage(target, CL_FALSE, origin, region, sourceView.pixels().row_size(), 0,
+		boost::gil::interleaved_view_get_raw_data(sourceView), nullptr, &event);
 	return event;
 }
 
+cl::Event copyImage(cl::CommandQueue const& queue, boost::gil::gray8_image_t const& source, cl::Image2D const& target)
+{
+	return copyImagePixels(queue, source, target);
+}
+
+cl::Event copyImage(cl::CommandQueue const& queue, boost::gil::rgba8_image_t const& source, cl::Image2D const& target)
+{
+	return copyImagePixels(queue, source, target);
+}
+
 std::string readFileToString(std::string const& filename)
 {
 	std::ifstream inputFile;
@@ -136,7 +157,7 @@ std::string readFileToString(std::string const& filename)
 	return std::string(begin, end);
 }
 
-cl::Program buildProgram(cl::Context const& context, cl::Device const& device, std::string const& programFile)
+cl::Program buildProgram(cl::Context const& context, cl::Device const& device, std::string const& programFile, std::string const& options)
 {
 	TimedEvent timer("build_program");
 
@@ -145,7 +166,7 @@ cl::Program buildProgram(cl::Context const& context, cl::Device const& device, s
 
 	try
 	{
-		program.build({ device });
+		program.build({ device }, options.c_str());
 		auto buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
 		std::cout << buildLog << std::endl;
 		return program;
@@ -158,4 +179,16 @@ cl::Program buildProgram(cl::Context const& context, cl::Device const& device, s
 
 		throw;
 	}
+}
+
+// Helper to get next up value for integer division
+static inline size_t DivUp(size_t dividend, size_t divisor)
+{
+	return (dividend % divisor == 0) ? (dividend / divisor) : (dividend / divisor + 1);
+}
+
+cl::NDRange roundUp(cl::NDRange const& dimension, cl::NDRange const& localWorkSize)
+{
+	return cl::NDRange(localWorkSize[0] * DivUp(dimension[0], localWorkSize[0]),
+		localWorkSize[1] * DivUp(dimension[1], localWorkSize[1]));
 }
\ No newline at end of file
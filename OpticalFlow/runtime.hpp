@@ -17,6 +17,7 @@
 
 #include <boost/gil/image.hpp>
 #include <boost/gil/gray.hpp>
+#include <boost/gil/rgba.hpp>
 #include <boost/gil/typedefs.hpp>
 #include <string>
 #include <chrono>
@@ -62,6 +63,15 @@ MappedImage mapImage(cl::CommandQueue const& queue, cl::Image2D const& image, cl
 
 void loadImage(std::string const& filename, boost::gil::gray8_image_t& image);
 
+void loadImage(std::string const& filename, boost::gil::rgba8_image_t& image);
+
+// Enqueues the upload without waiting for it, the source has to stay unchanged until the
+// returned event is complete
 cl::Event copyImage(cl::CommandQueue const& queue, boost::gil::gray8_image_t const& source, cl::Image2D const& target);
 
-cl::Program buildProgram(cl::Context const& context, cl::Device const& device, std::string const& programFile);
+cl::Event copyImage(cl::CommandQueue const& queue, boost::gil::rgba8_image_t const& source, cl::Image2D const& target);
+
+cl::Program buildProgram(cl::Context const& context, cl::Device const& device, std::string const& programFile, std::string const& options = "");
+
+// Global work size rounded up to a multiple of the local work size
+cl::NDRange roundUp(cl::NDRange const& dimension, cl::NDRange const& localWorkSize);
@@ -0,0 +1,186 @@
+#include "stream_scheduler.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+void writeSchedulerStats(std::ostream& out, SchedulerStats const& stats)
+{
+	out << "[Scheduler]: " << stats.frames << " frames in " << stats.seconds * 1000.0 << " ms, "
+		<< stats.framesPerSecond << " frames/s, latency mean " << stats.meanLatencyMs
+		<< " ms, median " << stats.medianLatencyMs << " ms, p95 " << stats.p95LatencyMs
+		<< " ms, max " << stats.maxLatencyMs << " ms, " << stats.blockedSubmits << " blocked submits, "
+		<< stats.droppedSubmits << " dropped submits\n";
+}
+
+StreamScheduler::StreamScheduler(std::size_t workerCount, std::size_t queueCapacity)
+	: m_workerCount(workerCount), m_queueCapacity(queueCapacity), m_pending(0), m_stopping(false), m_started(clock_t::now()),
+	m_lastCompleted(m_started), m_blockedSubmits(0), m_droppedSubmits(0)
+{
+	if (workerCount == 0 || queueCapacity == 0)
+		throw std::invalid_argument("The scheduler needs at least one worker and a queue capacity of at least one");
+
+	m_workers.reserve(workerCount);
+	for (std::size_t worker = 0; worker < workerCount; ++worker)
+		m_workers.push_back(std::thread(&StreamScheduler::run, this, worker));
+}
+
+StreamScheduler::~StreamScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_frameQueued.notify_all();
+	m_frameDone.notify_all();
+
+	for (auto& worker : m_workers)
+		worker.join();
+}
+
+std::size_t StreamScheduler::addStream()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_streams.push_back(Stream());
+	return m_streams.size() - 1;
+}
+
+void StreamScheduler::submit(std::size_t stream, Task task)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_streams[stream].frames.size() >= m_queueCapacity)
+	{
+		++m_blockedSubmits;
+		m_frameDone.wait(lock, [&] { return m_stopping || m_streams[stream].frames.size() < m_queueCapacity; });
+		if (m_stopping)
+			return;
+	}
+
+	Frame frame = { task, clock_t::now() };
+	m_streams[stream].frames.push_back(frame);
+	++m_pending;
+	lock.unlock();
+
+	m_frameQueued.notify_all();
+}
+
+bool StreamScheduler::trySubmit(std::size_t stream, Task task)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_stopping)
+		return false;
+	if (m_streams[stream].frames.size() >= m_queueCapacity)
+	{
+		++m_droppedSubmits;
+		return false;
+	}
+
+	Frame frame = { task, clock_t::now() };
+	m_streams[stream].frames.push_back(frame);
+	++m_pending;
+	lock.unlock();
+
+	m_frameQueued.notify_all();
+	return true;
+}
+
+void StreamScheduler::wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_frameDone.wait(lock, [&] { return m_pending == 0 || m_error; });
+
+	if (m_error)
+	{
+		auto error = m_error;
+		m_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+SchedulerStats StreamScheduler::getStats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	SchedulerStats stats = {};
+	stats.frames = m_latenciesMs.size();
+	stats.blockedSubmits = m_blockedSubmits;
+	stats.droppedSubmits = m_droppedSubmits;
+	stats.seconds = std::chrono::duration<double>(m_lastCompleted - m_started).count();
+	if (stats.frames == 0)
+		return stats;
+
+	auto latencies = m_latenciesMs;
+	std::sort(latencies.begin(), latencies.end());
+	for (auto latency : latencies)
+		stats.meanLatencyMs += latency;
+	stats.meanLatencyMs /= latencies.size();
+	stats.medianLatencyMs = latencies[latencies.size() / 2];
+	stats.p95LatencyMs = latencies[std::min(latencies.size() - 1, latencies.size() * 95 / 100)];
+	stats.maxLatencyMs = latencies.back();
+	if (stats.seconds > 0.0)
+		stats.framesPerSecond = stats.frames / stats.seconds;
+	return stats;
+}
+
+void StreamScheduler::resetStats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_started = clock_t::now();
+	m_lastCompleted = m_started;
+	m_blockedSubmits = 0;
+	m_droppedSubmits = 0;
+	m_latenciesMs.clear();
+}
+
+bool StreamScheduler::nextFrame(std::size_t worker, std::size_t& lastStream, Frame& frame)
+{
+	auto streamCount = m_streams.size();
+	for (std::size_t i = 1; i <= streamCount; ++i)
+	{
+		auto stream = (lastStream + i) % streamCount;
+		if (stream % m_workerCount != worker || m_streams[stream].frames.empty())
+			continue;
+
+		frame = m_streams[stream].frames.front();
+		m_streams[stream].frames.pop_front();
+		lastStream = stream;
+		return true;
+	}
+	return false;
+}
+
+void StreamScheduler::run(std::size_t worker)
+{
+	std::size_t lastStream = worker;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		Frame frame;
+		m_frameQueued.wait(lock, [&] { return m_stopping || nextFrame(worker, lastStream, frame); });
+		if (m_stopping)
+			return;
+
+		// The slot in the stream queue is free now, wake up a blocked producer
+		m_frameDone.notify_all();
+		lock.unlock();
+
+		std::exception_ptr error;
+		try
+		{
+			frame.task(worker);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		auto completed = clock_t::now();
+		lock.lock();
+		if (error && !m_error)
+			m_error = error;
+		m_latenciesMs.push_back(std::chrono::duration<double, std::milli>(completed - frame.submitted).count());
+		m_lastCompleted = completed;
+		--m_pending;
+		m_frameDone.notify_all();
+	}
+}
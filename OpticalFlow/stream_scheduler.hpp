@@ -0,0 +1,109 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iosfwd>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Aggregate metrics of all frames completed since the scheduler was started. Latency is the
+// time from submit() to the end of the task and includes the time spent in the stream queue.
+struct SchedulerStats
+{
+	std::size_t frames;
+	std::size_t blockedSubmits;
+	// Frames rejected by trySubmit() because the queue of the stream was full
+	std::size_t droppedSubmits;
+	double seconds;
+	double framesPerSecond;
+	double meanLatencyMs;
+	double medianLatencyMs;
+	double p95LatencyMs;
+	double maxLatencyMs;
+};
+
+void writeSchedulerStats(std::ostream& out, SchedulerStats const& stats);
+
+// Runs the frames of many independent streams on a pool of worker threads. Every stream is
+// pinned to one worker (stream % workerCount), so the frames of a stream are processed in
+// submission order and per-stream state like a FlowSession is only touched by one thread.
+// A worker serves its streams round robin.
+//
+// Every stream has a bounded queue. submit() blocks while the queue of the stream is full,
+// which throttles a producer to the rate its worker can sustain, trySubmit() drops instead.
+class StreamScheduler
+{
+public:
+	// Called on the worker thread with the index of the worker
+	typedef std::function<void(std::size_t worker)> Task;
+
+	StreamScheduler(std::size_t workerCount, std::size_t queueCapacity);
+
+	// Waits for the running tasks, frames still queued are discarded
+	~StreamScheduler();
+
+	StreamScheduler(StreamScheduler const&) = delete;
+	StreamScheduler& operator = (StreamScheduler const&) = delete;
+
+	std::size_t addStream();
+
+	std::size_t getWorker(std::size_t stream) const { return stream % m_workerCount; }
+
+	std::size_t getWorkerCount() const { return m_workerCount; }
+
+	void submit(std::size_t stream, Task task);
+
+	// Returns false if the queue of the stream is full
+	bool trySubmit(std::size_t stream, Task task);
+
+	// Blocks until all queued frames are processed. Rethrows the first exception of a task.
+	void wait();
+
+	SchedulerStats getStats() const;
+
+	// Starts a new measurement, e.g. after warm up frames
+	void resetStats();
+
+private:
+	typedef std::chrono::steady_clock clock_t;
+
+	struct Frame
+	{
+		Task task;
+		clock_t::time_point submitted;
+	};
+
+	struct Stream
+	{
+		std::deque<Frame> frames;
+	};
+
+	void run(std::size_t worker);
+
+	// Next stream of the worker with a queued frame, starting after the last served stream
+	bool nextFrame(std::size_t worker, std::size_t& lastStream, Frame& frame);
+
+	// Fixed before the first worker starts, the workers read it while m_workers is still filled
+	const std::size_t m_workerCount;
+	std::size_t m_queueCapacity;
+	std::vector<std::thread> m_workers;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_frameQueued;
+	std::condition_variable m_frameDone;
+	std::vector<Stream> m_streams;
+	std::size_t m_pending;
+	bool m_stopping;
+	std::exception_ptr m_error;
+
+	clock_t::time_point m_started;
+	clock_t::time_point m_lastCompleted;
+	std::size_t m_blockedSubmits;
+	std::size_t m_droppedSubmits;
+	std::vector<double> m_latenciesMs;
+};
@@ -0,0 +1,126 @@
+#include "tuning.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// Default tile size, the only source of LOCAL_X and LOCAL_Y of optical-flow.cl without a tuning file
+const cl::NDRange DEFAULT_TILE_SIZE(16, 8);
+
+TuningTable::TuningTable()
+	: m_frameWidth(0), m_frameHeight(0), m_tileSize(DEFAULT_TILE_SIZE)
+{ }
+
+TuningTable::TuningTable(std::size_t frameWidth, std::size_t frameHeight, std::string const& configuration)
+	: m_frameWidth(frameWidth), m_frameHeight(frameHeight), m_configuration(configuration), m_tileSize(DEFAULT_TILE_SIZE)
+{ }
+
+// File format, one entry per line:
+//   frame <width> <height> <configuration>
+//   tile <x> <y>
+//   <kernel name> <x> <y>
+bool TuningTable::load(std::string const& filename)
+{
+	std::ifstream inputFile(filename);
+	if (!inputFile)
+		return false;
+
+	std::size_t frameWidth = 0;
+	std::size_t frameHeight = 0;
+	std::string configuration;
+	std::map<std::string, cl::NDRange> localSizes;
+	cl::NDRange tileSize = DEFAULT_TILE_SIZE;
+
+	std::string line;
+	while (std::getline(inputFile, line))
+	{
+		std::istringstream entry(line);
+		std::string name;
+		std::size_t x = 0;
+		std::size_t y = 0;
+		if (!(entry >> name >> x >> y))
+			continue;
+
+		if (name == "frame")
+		{
+			frameWidth = x;
+			frameHeight = y;
+			entry >> configuration;
+		}
+		else if (name == "tile")
+			tileSize = cl::NDRange(x, y);
+		else
+			localSizes[name] = cl::NDRange(x, y);
+	}
+
+	if (frameWidth != m_frameWidth || frameHeight != m_frameHeight || configuration != m_configuration)
+	{
+		std::cout << "Tuning file " << filename << " is for " << frameWidth << "x" << frameHeight << " " << configuration
+			<< " and not " << m_frameWidth << "x" << m_frameHeight << " " << m_configuration << "\n";
+		return false;
+	}
+
+	m_localSizes = localSizes;
+	m_tileSize = tileSize;
+	return true;
+}
+
+void TuningTable::save(std::string const& filename) const
+{
+	std::ofstream outputFile;
+	outputFile.exceptions(std::ios_base::badbit | std::ios_base::failbit);
+	outputFile.open(filename);
+
+	outputFile << "frame " << m_frameWidth << " " << m_frameHeight << " " << m_configuration << "\n";
+	outputFile << "tile " << m_tileSize[0] << " " << m_tileSize[1] << "\n";
+	for (auto& entry : m_localSizes)
+		outputFile << entry.first << " " << entry.second[0] << " " << entry.second[1] << "\n";
+}
+
+cl::NDRange TuningTable::getLocalSize(std::string const& kernelName) const
+{
+	auto found = m_localSizes.find(kernelName);
+	return (found != m_localSizes.end()) ? found->second : cl::NullRange;
+}
+
+void TuningTable::setLocalSize(std::string const& kernelName, cl::NDRange const& localSize)
+{
+	if (localSize.dimensions() == 0)
+		m_localSizes.erase(kernelName);
+	else
+		m_localSizes[kernelName] = localSize;
+}
+
+std::string TuningTable::getProgramOptions() const
+{
+	return "-D LOCAL_X=" + std::to_string(m_tileSize[0]) + " -D LOCAL_Y=" + std::to_string(m_tileSize[1]);
+}
+
+std::string tuningFileName(cl::Device const& device)
+{
+	std::string name = device.getInfo<CL_DEVICE_NAME>() + "-" + device.getInfo<CL_DRIVER_VERSION>();
+	for (auto& c : name)
+	{
+		if (c == ' ' || c == '/' || c == '\\' || c == ':')
+			c = '_';
+	}
+	// Strings returned by the runtime may contain the terminating zero
+	name.erase(std::remove(name.begin(), name.end(), '\0'), name.end());
+	return "tuning-" + name + ".txt";
+}
+
+std::string kernelName(cl::Kernel const& kernel)
+{
+	auto name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+	name.erase(std::remove(name.begin(), name.end(), '\0'), name.end());
+	return name;
+}
+
+LaunchGraph::Node addTunedKernel(LaunchGraph& graph, TuningTable const& tuning, std::string const& name, cl::Kernel const& kernel,
+	cl::NDRange const& dimension, std::vector<LaunchGraph::Node> const& dependencies)
+{
+	auto localSize = tuning.getLocalSize(name);
+	auto globalSize = (localSize.dimensions() == 0) ? dimension : roundUp(dimension, localSize);
+	return graph.addKernel(name, kernel, globalSize, localSize, dependencies);
+}
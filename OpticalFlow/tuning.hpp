@@ -0,0 +1,54 @@
+#pragma once
+
+#include "runtime.hpp"
+#include "launch_graph.hpp"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Local work sizes per kernel for one device, frame size and program configuration. Kernels
+// without an entry are launched with cl::NullRange so the driver chooses the work-group size.
+// The kernels using local memory tiles share one tile size which is also compiled into the
+// program with -D. The configuration names everything else the best sizes depend on, e.g. the
+// number of channels and the flow kernel, and must not contain spaces.
+class TuningTable
+{
+public:
+	TuningTable();
+
+	TuningTable(std::size_t frameWidth, std::size_t frameHeight, std::string const& configuration);
+
+	// Returns false if the file does not exist or was tuned for another frame size or configuration
+	bool load(std::string const& filename);
+
+	void save(std::string const& filename) const;
+
+	cl::NDRange getLocalSize(std::string const& kernelName) const;
+
+	void setLocalSize(std::string const& kernelName, cl::NDRange const& localSize);
+
+	cl::NDRange const& getTileSize() const { return m_tileSize; }
+
+	void setTileSize(cl::NDRange const& tileSize) { m_tileSize = tileSize; }
+
+	std::string getProgramOptions() const;
+
+private:
+	std::size_t m_frameWidth;
+	std::size_t m_frameHeight;
+	std::string m_configuration;
+	cl::NDRange m_tileSize;
+	std::map<std::string, cl::NDRange> m_localSizes;
+};
+
+// Name of the tuning file of a device, e.g. "tuning-Intel(R)_HD_Graphics_4600-10.18.14.4170.txt"
+std::string tuningFileName(cl::Device const& device);
+
+// Function name of a kernel without the terminating zero some runtimes include
+std::string kernelName(cl::Kernel const& kernel);
+
+// Adds an image kernel with its tuned local size to the graph. The global size is rounded up
+// to a multiple of the local size, so the kernel has to check the bounds of its output.
+LaunchGraph::Node addTunedKernel(LaunchGraph& graph, TuningTable const& tuning, std::string const& name, cl::Kernel const& kernel,
+	cl::NDRange const& dimension, std::vector<LaunchGraph::Node> const& dependencies);